@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "project.h"
+#include <limits.h>
+
+/*
+ * Boot loop detection. The state file holds one line:
+ *
+ *   <pending> <count> <boot id>
+ *
+ * pending is set when a boot starts and cleared once it stayed up for the
+ * stability threshold, count is the number of consecutive watchdog boots
+ * that never got there. A channel timeout marks a pending boot before the
+ * reboot command runs, as that clean reboot does not show up in the boot
+ * status. The file is written at most three times per boot, and the boot id
+ * keeps a restarted daemon from counting the same boot twice.
+ */
+
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_SIZE 37
+
+/* Values of the pending field */
+#define BOOT_PENDING 1
+#define BOOT_PENDING_TIMEOUT 2
+
+static bool bootLoopReadBootId(char* bootId)
+{
+    FILE* f = fopen(BOOT_ID_FILE, "r");
+    if(!f) return false;
+
+    bool ok = fscanf(f, "%36s", bootId) == 1;
+    fclose(f);
+
+    return ok;
+}
+
+static bool bootLoopWrite(const char* file, int pending, uint32_t count, const char* bootId)
+{
+    char tmp[PATH_MAX];
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return false;
+
+    /* Replace atomically, a power cut leaves either the old or the new state */
+    if(dprintf(fd, "%d %u %s\n", pending, count, bootId) < 0 || fsync(fd)) {
+        int err = errno;
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return false;
+    }
+    close(fd);
+
+    if(rename(tmp, file)) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return false;
+    }
+
+    /* Persist the rename itself */
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", file);
+    char* slash = strrchr(dir, '/');
+    if(slash == dir) {
+        slash[1] = 0;
+    } else if(slash) {
+        *slash = 0;
+    } else {
+        strcpy(dir, ".");
+    }
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+
+    return true;
+}
+
+bool bootLoopCheck(WDTSystem* s)
+{
+    char bootId[BOOT_ID_SIZE] = "unknown";
+    char lastBootId[BOOT_ID_SIZE] = "";
+    int pending = 0;
+    unsigned int count = 0;
+
+    bootLoopReadBootId(bootId);
+
+    FILE* f = fopen(s->bootStateFile, "r");
+    if(f) {
+        if(fscanf(f, "%d %u %36s", &pending, &count, lastBootId) < 2) {
+            pending = 0;
+            count = 0;
+        }
+        fclose(f);
+    }
+
+    s->bootCount = count;
+    s->bootPending = pending;
+
+    /* Same boot, after an upgrade or a daemon restart: nothing to count */
+    if(s->resumed || !strcmp(bootId, lastBootId)) {
+        return s->bootCount >= s->bootLoopMax;
+    }
+
+    if(pending) {
+        /* The previous boot never became stable, count it if the watchdog ended it */
+        bool known = false;
+        bool byWatchdog = false;
+
+        for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+            if(driver->wdtBootStatusKnown) {
+                known = true;
+                byWatchdog |= driver->wdtBootByWatchdog;
+            }
+        }
+
+        /* Without boot status any unstable boot counts, as does one we rebooted on a timeout */
+        s->bootCount = (!known || byWatchdog || pending == BOOT_PENDING_TIMEOUT) ? count + 1 : 0;
+    } else {
+        s->bootCount = 0;
+    }
+
+    s->bootPending = true;
+    if(!bootLoopWrite(s->bootStateFile, BOOT_PENDING, s->bootCount, bootId)) {
+        fprintf(stderr, "Could not write boot state %s: %s\n", s->bootStateFile, strerror(errno));
+    }
+
+    return s->bootCount >= s->bootLoopMax;
+}
+
+void bootLoopStable(WDTSystem* s)
+{
+    char bootId[BOOT_ID_SIZE] = "unknown";
+
+    if(!s->bootPending) return;
+
+    bootLoopReadBootId(bootId);
+
+    if(!bootLoopWrite(s->bootStateFile, 0, 0, bootId)) {
+        fprintf(stderr, "Could not write boot state %s: %s\n", s->bootStateFile, strerror(errno));
+        return;
+    }
+
+    if(s->bootCount) {
+        fprintf(stderr, "System stable after %u unstable boots\n", s->bootCount);
+    }
+
+    s->bootPending = false;
+    s->bootCount = 0;
+}
+
+void bootLoopTimeout(WDTSystem* s)
+{
+    char bootId[BOOT_ID_SIZE] = "unknown";
+
+    /* A stable boot is not part of a loop, however it ends */
+    if(!s->bootStateFile || !s->bootPending) return;
+
+    bootLoopReadBootId(bootId);
+
+    if(!bootLoopWrite(s->bootStateFile, BOOT_PENDING_TIMEOUT, s->bootCount, bootId)) {
+        fprintf(stderr, "Could not write boot state %s: %s\n", s->bootStateFile, strerror(errno));
+    }
+}
+
+bool bootLoopDegrade(WDTSystem* s, char* policy, bool apply)
+{
+    uint32_t startupFactor = 1;
+    char* item;
+
+    /* Also called when not degraded, so a bad policy is found on the first boot */
+    for(item = strtok(policy, ","); item; item = strtok(NULL, ",")) {
+        if(!strncmp(item, "startup=", 8)) {
+            startupFactor = atoi(item + 8);
+            if(!startupFactor) goto invalid;
+        } else if(!strncmp(item, "ignore=", 7)) {
+            bool found = false;
+            for(WDTPort* port = s->port; port; port=port->next) {
+                if(!strcmp(port->name, item + 7)) {
+                    port->noReboot |= apply;
+                    found = true;
+                }
+            }
+            if(!found) goto invalid;
+        } else {
+            goto invalid;
+        }
+    }
+
+    for(WDTPort* port = s->port; port && apply; port=port->next) {
+        port->startupTimeoutSeconds *= startupFactor;
+    }
+
+    return true;
+
+invalid:
+    fprintf(stderr, "Invalid degraded policy item %s\n", item);
+    errno = EINVAL;
+    return false;
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "project.h"
+#include <limits.h>
+#include <sys/inotify.h>
+
+/*
+ * Event driven channel on a cgroup v2 directory. The port descriptor is an
+ * inotify watch on cgroup.events, memory.events and the parent directory.
+ * Pressure stall triggers get their own poll slots: the PSI poll hook
+ * consumes the event, so it would be lost when the trigger is nested in an
+ * epoll set.
+ */
+
+static const char* cgroupPressureFiles[] = { "cpu.pressure", "memory.pressure", "io.pressure" };
+
+static int cgroupOpenAt(WDTCgroup* cg, const char* file, int flags)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cg->path, file);
+
+    return open(path, flags | O_CLOEXEC);
+}
+
+/* Returns the value of key in a flat keyed file, -1 when absent */
+static int64_t cgroupReadKey(WDTCgroup* cg, const char* file, const char* key)
+{
+    char buf[512];
+
+    int fd = cgroupOpenAt(cg, file, O_RDONLY);
+    if(fd < 0) return -1;
+
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(len <= 0) return -1;
+    buf[len] = 0;
+
+    size_t keyLen = strlen(key);
+    for(char* line = buf; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if(!strncmp(line, key, keyLen) && line[keyLen] == ' ') {
+            return atoll(line + keyLen + 1);
+        }
+    }
+
+    return -1;
+}
+
+/* The populated and frozen state, also taken when the channel is created */
+static bool cgroupCheckState(WDTCgroup* cg)
+{
+    int64_t populated = cgroupReadKey(cg, "cgroup.events", "populated");
+
+    /* Removed, by systemd once its unit stopped, and our watches with it */
+    if(populated < 0) {
+        fprintf(stderr, "Cgroup %s is gone\n", cg->path);
+        return false;
+    }
+
+    if((cg->events & WDT_CGROUP_EMPTY) && populated == 0) {
+        fprintf(stderr, "Cgroup %s is empty\n", cg->path);
+        return false;
+    }
+
+    if((cg->events & WDT_CGROUP_FROZEN) && cgroupReadKey(cg, "cgroup.events", "frozen") == 1) {
+        fprintf(stderr, "Cgroup %s is frozen\n", cg->path);
+        return false;
+    }
+
+    return true;
+}
+
+bool cgroupCheck(WDTPort* port)
+{
+    WDTCgroup* cg = port->cgroup;
+    bool healthy = true;
+
+    /* Drain the notifications, the files themselves are the state */
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while((len = read(port->fd, buf, sizeof(buf))) > 0) {
+        for(char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            if(((struct inotify_event*)p)->mask & IN_IGNORED) {
+                fprintf(stderr, "Cgroup %s is gone\n", cg->path);
+                healthy = false;
+            }
+        }
+    }
+
+    if(cg->events & WDT_CGROUP_OOM) {
+        int64_t oomKills = cgroupReadKey(cg, "memory.events", "oom_kill");
+        if(oomKills > cg->oomKills) {
+            fprintf(stderr, "OOM kill in cgroup %s\n", cg->path);
+            healthy = false;
+        }
+        if(oomKills >= 0) {
+            cg->oomKills = oomKills;
+        }
+    }
+
+    if(healthy && !cgroupCheckState(cg)) {
+        healthy = false;
+    }
+
+    cg->checks++;
+    if(!healthy) {
+        cg->failures++;
+    } else if(!port->alive) {
+        /* Condition cleared */
+        portKick(port, false);
+    }
+
+    return healthy;
+}
+
+bool cgroupPressureReady(WDTPort* port, int fd)
+{
+    WDTCgroup* cg = port->cgroup;
+
+    for(int i=0; i<WDT_CGROUP_PRESSURE_MAX; i++) {
+        if(cg->pressureFd[i] == fd) {
+            fprintf(stderr, "Pressure stall in cgroup %s (%s)\n", cg->path, cgroupPressureFiles[i]);
+        }
+    }
+
+    cg->checks++;
+    cg->failures++;
+
+    return false;
+}
+
+static bool cgroupParseEvents(WDTCgroup* cg, char* events)
+{
+    for(char* event = strtok(events, ","); event; event = strtok(NULL, ",")) {
+        if(!strcmp(event, "oom")) {
+            cg->events |= WDT_CGROUP_OOM;
+        } else if(!strcmp(event, "empty")) {
+            cg->events |= WDT_CGROUP_EMPTY;
+        } else if(!strcmp(event, "frozen")) {
+            cg->events |= WDT_CGROUP_FROZEN;
+        } else {
+            /* <cpu|memory|io>=<stall us>/<window us> */
+            char* value = strchr(event, '=');
+            unsigned int stall, window;
+            if(!value || sscanf(value + 1, "%u/%u", &stall, &window) != 2) {
+                return false;
+            }
+            *value = 0;
+
+            unsigned int resource;
+            for(resource=0; resource<WDT_CGROUP_PRESSURE_MAX; resource++) {
+                if(!strncmp(cgroupPressureFiles[resource], event, strlen(event)) &&
+                        cgroupPressureFiles[resource][strlen(event)] == '.') {
+                    break;
+                }
+            }
+            if(resource == WDT_CGROUP_PRESSURE_MAX) {
+                return false;
+            }
+
+            cg->pressureStallUs[resource] = stall;
+            cg->pressureWindowUs[resource] = window;
+        }
+    }
+
+    return true;
+}
+
+WDTPort* cgroupChannelNew(const char* path, char* events)
+{
+    WDTPort* port = portAlloc(path, 0, 0);
+    if(!port) return NULL;
+
+    WDTCgroup* cg = (WDTCgroup*)calloc(1, sizeof(WDTCgroup));
+    if(!cg) goto error;
+
+    port->cgroup = cg;
+    port->noDeadline = true;
+    cg->path = port->name;
+    for(int i=0; i<WDT_CGROUP_PRESSURE_MAX; i++) {
+        cg->pressureFd[i] = -1;
+    }
+
+    if(!events || !*events) {
+        cg->events = WDT_CGROUP_OOM | WDT_CGROUP_EMPTY;
+    } else if(!cgroupParseEvents(cg, events)) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    bool healthy = true;
+
+    port->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(port->fd < 0) goto error;
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/cgroup.events", path);
+    if(inotify_add_watch(port->fd, file, IN_MODIFY) < 0) goto error;
+
+    /* Removing the cgroup only shows up in its parent, kernfs keeps the watched files around */
+    snprintf(file, sizeof(file), "%s", path);
+    char* slash = strrchr(file, '/');
+    if(slash && slash != file) {
+        *slash = 0;
+        if(inotify_add_watch(port->fd, file, IN_DELETE | IN_ONLYDIR) < 0) goto error;
+    }
+
+    if(cg->events & WDT_CGROUP_OOM) {
+        snprintf(file, sizeof(file), "%s/memory.events", path);
+        if(inotify_add_watch(port->fd, file, IN_MODIFY) < 0) goto error;
+
+        cg->oomKills = cgroupReadKey(cg, "memory.events", "oom_kill");
+
+        /* Count the kills that happened during an upgrade */
+        uint64_t value;
+        if(handoffTakeValue('o', path, &value)) {
+            if(cg->oomKills > (int64_t)value) {
+                fprintf(stderr, "OOM kill in cgroup %s\n", cg->path);
+                cg->failures++;
+                healthy = false;
+            }
+        }
+    }
+
+    for(int i=0; i<WDT_CGROUP_PRESSURE_MAX; i++) {
+        if(!cg->pressureWindowUs[i]) continue;
+
+        /* PSI trigger, see Documentation/accounting/psi.rst */
+        cg->pressureFd[i] = cgroupOpenAt(cg, cgroupPressureFiles[i], O_RDWR | O_NONBLOCK);
+        if(cg->pressureFd[i] < 0) goto error;
+
+        char trigger[64];
+        int len = snprintf(trigger, sizeof(trigger), "some %u %u", cg->pressureStallUs[i], cg->pressureWindowUs[i]);
+        if(write(cg->pressureFd[i], trigger, len + 1) < 0) goto error;
+    }
+
+    /* Event only, no deadline */
+    portKick(port, true);
+
+    /* Already unhealthy, fail on the first loop iteration like an expired channel */
+    if(!healthy || !cgroupCheckState(cg)) {
+        port->expirySeconds = 0;
+    }
+
+    return port;
+
+error:
+    portUninit(port);
+    return NULL;
+}
+
+void cgroupChannelFree(WDTPort* port)
+{
+    WDTCgroup* cg = port->cgroup;
+
+    for(int i=0; i<WDT_CGROUP_PRESSURE_MAX; i++) {
+        if(cg->pressureFd[i] >= 0) {
+            close(cg->pressureFd[i]);
+        }
+    }
+
+    free(cg);
+    port->cgroup = NULL;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "project.h"
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/*
+ * Health check channels run a shell command every interval. A zero exit
+ * status kicks the channel, anything else (or running past the timeout)
+ * lets its deadline run out. Children are supervised through a pidfd so
+ * the event loop can wait for them together with the sockets.
+ */
+
+static unsigned int checksRunning = 0;
+
+WDTPort* checkChannelNew(const char* name, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds,
+                         uint32_t intervalSeconds, uint32_t timeoutSeconds, const char* command)
+{
+    if(!intervalSeconds || !command || !*command) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    WDTPort* port = portAlloc(name, startupTimeoutSeconds, normalTimeoutSeconds);
+    if(!port) return NULL;
+
+    WDTCheck* c = (WDTCheck*)calloc(1, sizeof(WDTCheck));
+    if(!c) goto error;
+
+    port->check = c;
+    c->pid = -1;
+    c->pidFd = -1;
+    c->intervalSeconds = intervalSeconds;
+    c->timeoutSeconds = timeoutSeconds ? timeoutSeconds : intervalSeconds;
+
+    c->command = strdup(command);
+    if(!c->command) goto error;
+
+    /* Continue the deadline of a previous instance */
+    uint64_t value;
+    if(handoffTakeValue('h', name, &value)) {
+        port->expirySeconds = value;
+        port->alive = true;
+        return port;
+    }
+
+    portKick(port, true);
+
+    return port;
+
+error:
+    portUninit(port);
+    return NULL;
+}
+
+void checkChannelFree(WDTPort* port)
+{
+    WDTCheck* c = port->check;
+
+    checkStop(port);
+
+    free(c->command);
+    free(c);
+    port->check = NULL;
+}
+
+static bool checkStart(WDTCheck* c, uint64_t nowSeconds)
+{
+    /* In its own process group, so a timeout takes down the whole pipeline */
+    pid_t pid = utilSpawnShell(c->command);
+    if(pid < 0) return false;
+
+    c->pidFd = syscall(__NR_pidfd_open, pid, 0);
+    if(c->pidFd < 0) {
+        /* Cannot wait for it in the event loop, do not leave it behind */
+        int err = errno;
+        kill(-pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        errno = err;
+        return false;
+    }
+
+    c->pid = pid;
+    c->killed = false;
+    c->runs++;
+    c->deadlineSeconds = nowSeconds + c->timeoutSeconds;
+    checksRunning++;
+
+    return true;
+}
+
+static void checkKill(WDTCheck* c)
+{
+    syscall(__NR_pidfd_send_signal, c->pidFd, SIGKILL, NULL, 0);
+
+    /* The leader is not reaped yet, so its process group id is still ours */
+    kill(-c->pid, SIGKILL);
+    c->killed = true;
+}
+
+uint64_t checkRun(WDTSystem* s, uint64_t nowSeconds)
+{
+    uint64_t next = -1ULL;
+
+    /* Kill overrunning checks, they are reaped once their pidfd fires */
+    for(WDTPort* port = s->port; port; port=port->next) {
+        WDTCheck* c = port->check;
+        if(!c || c->pidFd < 0 || c->killed) continue;
+
+        if(c->deadlineSeconds <= nowSeconds) {
+            fprintf(stderr, "Health check %s timed out\n", port->name);
+            c->timeouts++;
+            checkKill(c);
+        } else if(c->deadlineSeconds < next) {
+            next = c->deadlineSeconds;
+        }
+    }
+
+    /* Start due checks, the longest waiting first, while slots are free */
+    while(!s->maxChecks || checksRunning < s->maxChecks) {
+        WDTPort* due = NULL;
+
+        for(WDTPort* port = s->port; port; port=port->next) {
+            WDTCheck* c = port->check;
+            if(!c || c->pidFd >= 0 || c->nextRunSeconds > nowSeconds) continue;
+
+            if(!due || c->nextRunSeconds < due->check->nextRunSeconds) {
+                due = port;
+            }
+        }
+
+        if(!due) break;
+
+        /* Fixed rate from the actual start, a queued check does not catch up */
+        due->check->nextRunSeconds = nowSeconds + due->check->intervalSeconds;
+
+        if(!checkStart(due->check, nowSeconds)) {
+            fprintf(stderr, "Could not run health check %s: %s\n", due->name, strerror(errno));
+            due->check->failures++;
+        } else if(due->check->deadlineSeconds < next) {
+            next = due->check->deadlineSeconds;
+        }
+    }
+
+    /* Queued checks are started when a running one is reaped */
+    for(WDTPort* port = s->port; port; port=port->next) {
+        WDTCheck* c = port->check;
+        if(c && c->pidFd < 0 && c->nextRunSeconds > nowSeconds && c->nextRunSeconds < next) {
+            next = c->nextRunSeconds;
+        }
+    }
+
+    return next;
+}
+
+bool checkReap(WDTPort* port)
+{
+    WDTCheck* c = port->check;
+    siginfo_t info;
+
+    if(c->pidFd < 0) return false;
+
+    /* Through the pidfd, the pid may not be ours anymore once reaped */
+    info.si_pid = 0;
+    int ret = waitid(P_PIDFD, c->pidFd, &info, WEXITED | WNOHANG);
+    if((ret == 0 && info.si_pid == 0) || (ret < 0 && errno == EINTR)) return false;
+
+    close(c->pidFd);
+    c->pidFd = -1;
+    c->pid = -1;
+    checksRunning--;
+
+    if(ret < 0 || c->killed) {
+        return false;
+    }
+
+    if(info.si_code == CLD_EXITED && info.si_status == 0) {
+        return true;
+    }
+
+    c->failures++;
+    if(info.si_code == CLD_EXITED) {
+        fprintf(stderr, "Health check %s failed with status %d\n", port->name, info.si_status);
+    } else {
+        fprintf(stderr, "Health check %s killed by signal %d\n", port->name, info.si_status);
+    }
+
+    return false;
+}
+
+void checkStop(WDTPort* port)
+{
+    WDTCheck* c = port->check;
+
+    if(c->pidFd < 0) return;
+
+    checkKill(c);
+
+    siginfo_t info;
+    while(waitid(P_PIDFD, c->pidFd, &info, WEXITED) < 0 && errno == EINTR);
+
+    close(c->pidFd);
+    c->pidFd = -1;
+    c->pid = -1;
+    checksRunning--;
+}
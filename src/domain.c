@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "project.h"
+#include <sys/wait.h>
+
+/*
+ * Channels and drivers outside the default domain fail on their own: the
+ * domain runs its command and stops kicking its drivers, or re-arms its
+ * channels when it has no drivers. Only the default domain reboots.
+ *
+ * Domain drivers must reset the hardware they guard, not the system: once
+ * that brought all channels of the domain back, its drivers are kicked again.
+ */
+
+WDTDomain* domainNew(const char* name, const char* command)
+{
+    WDTDomain* domain = (WDTDomain*)calloc(1, sizeof(WDTDomain));
+    if(!domain) return NULL;
+
+    domain->commandPid = -1;
+
+    domain->name = strdup(name);
+    if(!domain->name) goto error;
+
+    if(command && *command) {
+        domain->command = strdup(command);
+        if(!domain->command) goto error;
+    }
+
+    /* A failed domain stays failed across an upgrade */
+    uint64_t value;
+    if(handoffTakeValue('D', name, &value)) {
+        domain->failed = value;
+    }
+
+    /* Its command is still our child after exec, keep reaping it */
+    if(handoffTakeValue('P', name, &value)) {
+        domain->commandPid = value;
+    }
+
+    return domain;
+
+error:
+    domainFree(domain);
+    return NULL;
+}
+
+void domainFree(WDTDomain* domain)
+{
+    if(!domain) return;
+
+    free(domain->name);
+    free(domain->command);
+    free(domain);
+}
+
+void domainAddPort(WDTDomain* domain, WDTPort* port)
+{
+    port->domain = domain;
+    domain->channels++;
+}
+
+void domainAddDriver(WDTDomain* domain, WDTHWDriver* driver)
+{
+    driver->domain = domain;
+    domain->drivers++;
+}
+
+bool domainFail(WDTDomain* domain)
+{
+    if(domain->failed) return true;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    domain->failed = true;
+    domain->failures++;
+    domain->lastFailureSeconds = now.tv_sec;
+
+    fprintf(stderr, "Watchdog domain %s failed\n", domain->name);
+
+    /* The previous run is reaped by domainRun, do not pile them up */
+    if(domain->command && domain->commandPid < 0) {
+        printf("Running: %s\n", domain->command);
+        fflush(stdout);
+
+        domain->commandPid = utilSpawnShell(domain->command);
+        if(domain->commandPid < 0) {
+            fprintf(stderr, "Could not run %s: %s\n", domain->command, strerror(errno));
+        }
+    }
+
+    /* Never takes the rest of the system down */
+    return true;
+}
+
+/* Dead channels are handed over by an upgrade as alive but expired */
+static bool domainPortUp(WDTPort* port, uint64_t nowSeconds)
+{
+    return port->alive && port->expirySeconds > nowSeconds;
+}
+
+/*
+ * Recovered once the domain would not fail anymore: every group has its
+ * quorum back and every channel that fails the domain on its own is up.
+ */
+static bool domainRecovered(WDTSystem* s, WDTDomain* domain)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(WDTPort* port = s->port; port; port=port->next) {
+        if(port->domain != domain) continue;
+
+        if(port->group) {
+            uint32_t alive = 0;
+            for(WDTPort* member = s->port; member; member=member->next) {
+                if(member->group == port->group && domainPortUp(member, now.tv_sec)) {
+                    alive++;
+                }
+            }
+
+            if(alive < port->group->minAlive) return false;
+        } else if(!port->noReboot && !domainPortUp(port, now.tv_sec)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void domainRun(WDTSystem* s)
+{
+    for(WDTDomain* domain = s->domain; domain; domain=domain->next) {
+        if(domain->commandPid > 0) {
+            int status;
+            pid_t ret = waitpid(domain->commandPid, &status, WNOHANG);
+            if(ret == domain->commandPid) {
+                printf("Domain %s command return value: %d\n", domain->name, status);
+                domain->commandPid = -1;
+            } else if(ret < 0 && errno != EINTR) {
+                domain->commandPid = -1;
+            }
+        }
+
+        if(!domain->failed) continue;
+
+        /* With drivers, wait for the hardware reset to bring the domain back */
+        if(domain->drivers) {
+            if(domainRecovered(s, domain)) {
+                fprintf(stderr, "Watchdog domain %s recovered\n", domain->name);
+                domain->failed = false;
+            }
+            continue;
+        }
+
+        /* Give the channels a startup interval to recover */
+        for(WDTPort* port = s->port; port; port=port->next) {
+            if(port->domain == domain) {
+                portKick(port, true);
+            }
+        }
+
+        domain->failed = false;
+    }
+}
@@ -26,48 +26,242 @@
  */
 
 #include "../project.h"
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
+/*
+ * Without hardware, i2c-stub emulates a chip with 256 byte registers:
+ *
+ *   modprobe i2c-stub chip_addr=0x50
+ *   mahiwdt -w i2c:/dev/i2c-<bus>:0x50:10a5:1:a5 ...
+ *
+ * Every kick writes 0xa5 to register 0x10 and expects it back, changing the
+ * register with i2cset makes the kicks fail. i2c-stub only speaks
+ * SMBus, so this covers the SMBus fallback. For the I2C_RDWR path use a
+ * bus with plain I2C, e.g. i2c-gpio on spare pins or a USB adapter.
+ */
+
+/* Attempts per kick, with exponential backoff starting at I2C_BACKOFF_US */
+#define I2C_ATTEMPTS 3
+#define I2C_BACKOFF_US 1000
+
 struct i2cWDTContext {
     char* bus;
     uint8_t addr;
-    
-    char* data;
+
+    uint8_t* data;
     unsigned int dataLen;
+
+    /* Acknowledgement or status expected back from the supervisor */
+    uint8_t* expect;
+    unsigned int expectLen;
+
+    /* Kept open between kicks, reopened after an error */
+    int fd;
+
+    /* Adapter lacks plain I2C (e.g. i2c-stub), use SMBus transfers */
+    bool smbus;
+
+    uint64_t kicks;
+    uint64_t failures;
+    uint64_t retries;
+    uint64_t reopens;
+    bool failing;
+    WDTHistogram latency;
 };
 
+static void i2cWDTDriverClose(struct i2cWDTContext* c)
+{
+    if(c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
 static void i2cWDTDriverFree(void* context)
 {
     struct i2cWDTContext* c = (struct i2cWDTContext*)context;
 
     if(c) {
+        i2cWDTDriverClose(c);
+
         if (c->bus) {
             free(c->bus);
         }
         if (c->data) {
             free(c->data);
         }
+        if (c->expect) {
+            free(c->expect);
+        }
 
         free(c);
     }
 }
 
+static bool i2cWDTDriverOpen(struct i2cWDTContext* c)
+{
+    c->fd = open(c->bus, O_RDWR | O_CLOEXEC);
+    if(c->fd < 0) return false;
+
+    unsigned long funcs = 0;
+    if(ioctl(c->fd, I2C_FUNCS, &funcs) < 0) goto failed;
+
+    c->smbus = !(funcs & I2C_FUNC_I2C);
+    if(c->smbus) {
+        if(!(funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) || (c->expectLen && !(funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK))) {
+            errno = EOPNOTSUPP;
+            goto failed;
+        }
+
+        if(ioctl(c->fd, I2C_SLAVE, c->addr) < 0) goto failed;
+    }
+
+    return true;
+
+failed:
+    i2cWDTDriverClose(c);
+    return false;
+}
+
+static int i2cWDTDriverSMBus(struct i2cWDTContext* c, char readWrite, uint8_t* buf, unsigned int len)
+{
+    union i2c_smbus_data data;
+    struct i2c_smbus_ioctl_data args = {
+        .read_write = readWrite,
+        .command = c->data[0],
+        .size = I2C_SMBUS_I2C_BLOCK_DATA,
+        .data = &data
+    };
+
+    /* A lone register byte */
+    if(!len) {
+        args.size = I2C_SMBUS_BYTE;
+        args.data = NULL;
+    }
+
+    data.block[0] = len;
+    if(readWrite == I2C_SMBUS_WRITE) {
+        memcpy(data.block + 1, buf, len);
+    }
+
+    if(ioctl(c->fd, I2C_SMBUS, &args) < 0) return -1;
+
+    if(readWrite == I2C_SMBUS_READ) {
+        memcpy(buf, data.block + 1, len);
+    }
+
+    return 0;
+}
+
+static bool i2cWDTDriverTransfer(struct i2cWDTContext* c)
+{
+    uint8_t readBuf[I2C_SMBUS_BLOCK_MAX];
+
+    if(c->smbus) {
+        /* First byte is the register, the rest is written as a block */
+        if(i2cWDTDriverSMBus(c, I2C_SMBUS_WRITE, c->data + 1, c->dataLen - 1)) return false;
+        if(c->expectLen && i2cWDTDriverSMBus(c, I2C_SMBUS_READ, readBuf, c->expectLen)) return false;
+    } else {
+        /* Write and read back in one combined transaction (repeated start) */
+        struct i2c_msg msgs[2] = {
+            { .addr = c->addr, .flags = 0, .len = c->dataLen, .buf = c->data },
+            { .addr = c->addr, .flags = I2C_M_RD, .len = c->expectLen, .buf = readBuf }
+        };
+        struct i2c_rdwr_ioctl_data rdwr = {
+            .msgs = msgs,
+            .nmsgs = c->expectLen ? 2 : 1
+        };
+
+        /* A short count is a failure of its own, errno may be stale then */
+        int ret = ioctl(c->fd, I2C_RDWR, &rdwr);
+        if(ret != (int)rdwr.nmsgs) {
+            if(ret >= 0) errno = EIO;
+            return false;
+        }
+    }
+
+    if(c->expectLen && memcmp(readBuf, c->expect, c->expectLen)) {
+        errno = EPROTO;
+        return false;
+    }
+
+    return true;
+}
+
 static void i2cWDTDriverKick(void* context)
 {
     struct i2cWDTContext* c = (struct i2cWDTContext*)context;
-    
-    int fd = open(c->bus, O_RDWR);
-    if(fd < 0) return;
 
-    if (ioctl(fd, I2C_SLAVE, c->addr) < 0) goto failed;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    write(fd, c->data, c->dataLen);
+    bool success = false;
+    for(int attempt=0; attempt<I2C_ATTEMPTS && !success; attempt++) {
+        if(attempt) {
+            struct timespec backoff = { 0, (I2C_BACKOFF_US << (attempt - 1)) * 1000L };
+            nanosleep(&backoff, NULL);
+            c->retries++;
+        }
 
-failed:
-    close(fd);
+        if(c->fd < 0) {
+            if(!i2cWDTDriverOpen(c)) continue;
+            c->reopens++;
+        }
+
+        success = i2cWDTDriverTransfer(c);
+
+        /* A wrong answer is the chip talking, anything else may be a stale handle */
+        if(!success && errno != EPROTO) {
+            i2cWDTDriverClose(c);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    histogramAdd(&c->latency, (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000);
+
+    c->kicks++;
+    if(!success) {
+        c->failures++;
+    }
+
+    if(success == c->failing) {
+        fprintf(stderr, "I2C watchdog 0x%02x on %s %s\n", c->addr, c->bus, success ? "recovered" : "kick failed");
+        c->failing = !success;
+    }
 }
 
-WDTHWDriver* i2cWDTDriverNew(const char* bus, uint8_t addr, char* wrData, unsigned int interval)
+static void i2cWDTDriverStatus(void* context, FILE* f)
+{
+    struct i2cWDTContext* c = (struct i2cWDTContext*)context;
+
+    fprintf(f, "I2C watchdog 0x%02x on %s: %llu kicks, %llu failures, %llu retries, %llu reopens\n",
+            c->addr, c->bus, (unsigned long long)c->kicks, (unsigned long long)c->failures,
+            (unsigned long long)c->retries, (unsigned long long)c->reopens);
+    histogramPrint(&c->latency, f, "  Kick latency", "us");
+}
+
+static uint8_t* i2cWDTDriverParseHex(const char* hex, unsigned int* len)
+{
+    size_t hexLen = strlen(hex);
+    if (hexLen % 2) return NULL;
+
+    uint8_t* data = (uint8_t*)malloc(hexLen/2 + 1);
+    if(!data) return NULL;
+    *len = hexLen/2;
+
+    for (int i=0; i<hexLen; i+=2){
+        char h[] = {hex[i], hex[i+1], 0};
+
+        int value;
+        sscanf(h, "%02x", &value);
+        data[i/2] = value;
+    }
+
+    return data;
+}
+
+WDTHWDriver* i2cWDTDriverNew(const char* bus, uint8_t addr, char* wrData, char* expectData, unsigned int interval)
 {
     WDTHWDriver* d = (WDTHWDriver*)calloc(1, sizeof(WDTHWDriver));
     if(!d) return NULL;
@@ -78,30 +272,32 @@ WDTHWDriver* i2cWDTDriverNew(const char* bus, uint8_t addr, char* wrData, unsign
     d->wdtContext = c;
     d->wdtFreeFunc = i2cWDTDriverFree;
     d->wdtKickFunc = i2cWDTDriverKick;
+    d->wdtStatusFunc = i2cWDTDriverStatus;
     d->wdtMaxIntervalSeconds = interval;
-    
+
+    c->fd = -1;
+
     c->bus = strdup(bus);
     if(!c->bus) goto failed;
 
     c->addr = addr;
 
-    size_t len = strlen(wrData);
-    if (len % 2) goto failed;
+    errno = EINVAL;
 
-    c->data = (char*)malloc(len/2);
-    c->dataLen = len/2;
+    c->data = i2cWDTDriverParseHex(wrData, &c->dataLen);
+    if(!c->data || !c->dataLen || c->dataLen > I2C_SMBUS_BLOCK_MAX) goto failed;
 
-    for (int i=0; i<len; i+=2){
-        char h[] = {wrData[i], wrData[i+1], 0};
-        
-        int value;
-        sscanf(h, "%02x", &value);
-        c->data[i/2] = value;
+    if(expectData) {
+        c->expect = i2cWDTDriverParseHex(expectData, &c->expectLen);
+        if(!c->expect || !c->expectLen || c->expectLen > I2C_SMBUS_BLOCK_MAX) goto failed;
     }
 
+    /* Open now, while we may still have the privileges to */
+    if(!i2cWDTDriverOpen(c)) goto failed;
+
     return d;
 
 failed:
-    i2cWDTDriverFree(d);
+    wdtDriverFree(d);
     return NULL;
 }
@@ -30,6 +30,16 @@
 
 struct kernelWDTContext {
     int fd;
+    char* path;
+
+    int timeout;
+    int pretimeout;
+    uint32_t options;
+    bool timeLeftSupported;
+
+    /* Seconds left on the hardware timer right before each kick */
+    WDTHistogram slack;
+    bool slackWarned;
 };
 
 static void kernelWDTDriverFree(void* context)
@@ -40,6 +50,9 @@ static void kernelWDTDriverFree(void* context)
         if(c->fd >= 0) {
             close (c->fd);
         }
+        if(c->path) {
+            free(c->path);
+        }
 
         free(c);
     }
@@ -49,10 +62,50 @@ static void kernelWDTDriverKick(void* context)
 {
     struct kernelWDTContext* c = (struct kernelWDTContext*)context;
 
+    if(c->timeLeftSupported) {
+        int timeLeft;
+        if(ioctl(c->fd, WDIOC_GETTIMELEFT, &timeLeft) == 0) {
+            histogramAdd(&c->slack, timeLeft);
+
+            /* Within a quarter of the timeout (or into the pretimeout) is too close */
+            if(!c->slackWarned && (timeLeft * 4 < c->timeout || timeLeft <= c->pretimeout)) {
+                fprintf(stderr, "Kernel watchdog %s was kicked with only %ds left\n", c->path, timeLeft);
+                c->slackWarned = true;
+            }
+        } else {
+            c->timeLeftSupported = false;
+        }
+    }
+
     ioctl(c->fd, WDIOC_KEEPALIVE, NULL);
 }
 
-WDTHWDriver* kernelWDTDriverNew(const char* path, int interval)
+static int kernelWDTDriverHandoff(void* context, const char** key)
+{
+    struct kernelWDTContext* c = (struct kernelWDTContext*)context;
+
+    *key = c->path;
+    return c->fd;
+}
+
+static void kernelWDTDriverStatus(void* context, FILE* f)
+{
+    struct kernelWDTContext* c = (struct kernelWDTContext*)context;
+
+    fprintf(f, "Kernel watchdog %s: timeout %ds, pretimeout %ds", c->path, c->timeout, c->pretimeout);
+
+    int status;
+    if(ioctl(c->fd, WDIOC_GETSTATUS, &status) == 0) {
+        fprintf(f, ", status 0x%x", status);
+    }
+    fprintf(f, "\n");
+
+    if(c->slack.samples) {
+        histogramPrint(&c->slack, f, "  Time left at kick", "s");
+    }
+}
+
+WDTHWDriver* kernelWDTDriverNew(const char* path, int interval, int pretimeout, int kickInterval)
 {
     WDTHWDriver* d = (WDTHWDriver*)calloc(1, sizeof(WDTHWDriver));
     if(!d) return NULL;
@@ -63,10 +116,37 @@ WDTHWDriver* kernelWDTDriverNew(const char* path, int interval)
     d->wdtContext = c;
     d->wdtFreeFunc = kernelWDTDriverFree;
     d->wdtKickFunc = kernelWDTDriverKick;
-
-    c->fd = open(path, O_RDWR);
+    d->wdtHandoffFunc = kernelWDTDriverHandoff;
+    d->wdtStatusFunc = kernelWDTDriverStatus;
+
+    c->path = strdup(path);
+    if(!c->path) goto failed;
+
+    /* The device only allows a single opener, reuse the one of a previous instance */
+    bool resumed = true;
+    c->fd = handoffTake('d', path, NULL);
+    if(c->fd < 0) {
+        c->fd = open(path, O_RDWR | O_CLOEXEC);
+        resumed = false;
+    }
     if(c->fd < 0) goto failed;
 
+    struct watchdog_info info;
+    if(ioctl(c->fd, WDIOC_GETSUPPORT, &info) == 0) {
+        c->options = info.options;
+    }
+
+    /* Only report the reset cause on a real boot, not after an upgrade */
+    int bootStatus;
+    if(!resumed && (c->options & WDIOF_CARDRESET) && ioctl(c->fd, WDIOC_GETBOOTSTATUS, &bootStatus) == 0) {
+        d->wdtBootStatusKnown = true;
+        d->wdtBootByWatchdog = (bootStatus & WDIOF_CARDRESET) != 0;
+
+        if(d->wdtBootByWatchdog) {
+            fprintf(stderr, "Last reset was caused by watchdog %s\n", path);
+        }
+    }
+
     /* Failure is harmless */
     ioctl(c->fd, WDIOC_SETTIMEOUT, &interval);
 
@@ -76,17 +156,37 @@ WDTHWDriver* kernelWDTDriverNew(const char* path, int interval)
         realInterval = 0;
     }
 
-    if(realInterval < 2) {
-        realInterval = 2;
+    c->timeout = realInterval;
+
+    if(pretimeout > 0 && (c->options & WDIOF_PRETIMEOUT)) {
+        ioctl(c->fd, WDIOC_SETPRETIMEOUT, &pretimeout);
     }
+    if(ioctl(c->fd, WDIOC_GETPRETIMEOUT, &c->pretimeout) || c->pretimeout < 0) {
+        c->pretimeout = 0;
+    }
+
+    /* Probe on the first kick */
+    c->timeLeftSupported = true;
 
-    realInterval /= 2;
+    /* The pretimeout fires first, that is the deadline we have to meet */
+    realInterval -= c->pretimeout;
+
+    if(kickInterval > 0 && kickInterval < realInterval) {
+        /* Measured from the time left histogram */
+        realInterval = kickInterval;
+    } else {
+        if(realInterval < 2) {
+            realInterval = 2;
+        }
+
+        realInterval /= 2;
+    }
 
     d->wdtMaxIntervalSeconds = realInterval;
 
     return d;
 
 failed:
-    kernelWDTDriverFree(d);
+    wdtDriverFree(d);
     return NULL;
 }
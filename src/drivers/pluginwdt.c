@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../project.h"
+#include "../mahiwdt_plugin.h"
+#include <dlfcn.h>
+#include <stddef.h>
+
+/* Hooks past the size the plugin was built with do not exist */
+#define PLUGIN_HAS(p, hook) \
+    (offsetof(MahiWDTPlugin, hook) + sizeof((p)->hook) <= (p)->size && (p)->hook)
+
+struct pluginWDTContext {
+    void* handle;
+    const MahiWDTPlugin* plugin;
+    void* pluginContext;
+
+    /* Identifies the handed over descriptor, file and arguments */
+    char* key;
+
+    uint64_t kickFailures;
+    uint64_t healthFailures;
+    bool healthy;
+};
+
+static void pluginWDTDriverFree(void* context)
+{
+    struct pluginWDTContext* c = (struct pluginWDTContext*)context;
+
+    if(c) {
+        if(c->pluginContext) {
+            c->plugin->close(c->pluginContext);
+        }
+        if(c->handle) {
+            dlclose(c->handle);
+        }
+
+        free(c->key);
+        free(c);
+    }
+}
+
+static void pluginWDTDriverCheckHealth(struct pluginWDTContext* c)
+{
+    if(!PLUGIN_HAS(c->plugin, health)) return;
+
+    bool healthy = c->plugin->health(c->pluginContext) == 0;
+    if(!healthy) {
+        c->healthFailures++;
+    }
+
+    if(healthy != c->healthy) {
+        fprintf(stderr, "Watchdog plugin %s reports %s\n", c->plugin->name, healthy ? "healthy" : "unhealthy");
+        c->healthy = healthy;
+    }
+}
+
+static void pluginWDTDriverKick(void* context)
+{
+    struct pluginWDTContext* c = (struct pluginWDTContext*)context;
+
+    if(c->plugin->kick(c->pluginContext)) {
+        c->kickFailures++;
+    }
+
+    pluginWDTDriverCheckHealth(c);
+}
+
+static int pluginWDTDriverKickStart(void* context)
+{
+    struct pluginWDTContext* c = (struct pluginWDTContext*)context;
+
+    int fd = c->plugin->kickStart(c->pluginContext);
+    if(fd < 0) {
+        c->kickFailures++;
+    }
+
+    return fd;
+}
+
+static void pluginWDTDriverKickFinish(void* context)
+{
+    struct pluginWDTContext* c = (struct pluginWDTContext*)context;
+
+    if(PLUGIN_HAS(c->plugin, kickFinish) && c->plugin->kickFinish(c->pluginContext)) {
+        c->kickFailures++;
+    }
+
+    pluginWDTDriverCheckHealth(c);
+}
+
+static int pluginWDTDriverHandoff(void* context, const char** key)
+{
+    struct pluginWDTContext* c = (struct pluginWDTContext*)context;
+
+    /* Without resume the new instance could not use it, it opens again */
+    if(!PLUGIN_HAS(c->plugin, resume)) return -1;
+
+    *key = c->key;
+    return c->plugin->handoff(c->pluginContext);
+}
+
+static void pluginWDTDriverStatus(void* context, FILE* f)
+{
+    struct pluginWDTContext* c = (struct pluginWDTContext*)context;
+
+    fprintf(f, "Plugin watchdog %s: %llu kick failures", c->plugin->name, (unsigned long long)c->kickFailures);
+
+    if(PLUGIN_HAS(c->plugin, health)) {
+        fprintf(f, ", %s, %llu health failures", c->healthy ? "healthy" : "unhealthy",
+                (unsigned long long)c->healthFailures);
+    }
+
+    if(PLUGIN_HAS(c->plugin, timeLeft)) {
+        int timeLeft = c->plugin->timeLeft(c->pluginContext);
+        if(timeLeft >= 0) {
+            fprintf(f, ", %ds left", timeLeft);
+        }
+    }
+
+    fprintf(f, "\n");
+}
+
+WDTHWDriver* pluginWDTDriverNew(const char* file, const char* args)
+{
+    WDTHWDriver* d = (WDTHWDriver*)calloc(1, sizeof(WDTHWDriver));
+    if(!d) return NULL;
+
+    struct pluginWDTContext* c = calloc(1, sizeof(struct pluginWDTContext));
+    if(!c) goto failed;
+
+    d->wdtContext = c;
+    d->wdtFreeFunc = pluginWDTDriverFree;
+    d->wdtStatusFunc = pluginWDTDriverStatus;
+
+    c->handle = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+    if(!c->handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        errno = ENOENT;
+        goto failed;
+    }
+
+    c->plugin = (const MahiWDTPlugin*)dlsym(c->handle, MAHIWDT_PLUGIN_SYMBOL);
+    if(!c->plugin || c->plugin->abiVersion != MAHIWDT_PLUGIN_ABI_VERSION ||
+            c->plugin->size < offsetof(MahiWDTPlugin, kickStart) || !c->plugin->open || !c->plugin->close) {
+        fprintf(stderr, "%s is not a compatible watchdog plugin\n", file);
+        c->plugin = NULL;
+        errno = EINVAL;
+        goto failed;
+    }
+
+    if(PLUGIN_HAS(c->plugin, kickStart)) {
+        d->wdtKickStartFunc = pluginWDTDriverKickStart;
+        d->wdtKickFinishFunc = pluginWDTDriverKickFinish;
+    } else if(c->plugin->kick) {
+        d->wdtKickFunc = pluginWDTDriverKick;
+    } else {
+        errno = EINVAL;
+        goto failed;
+    }
+
+    if(PLUGIN_HAS(c->plugin, handoff)) {
+        d->wdtHandoffFunc = pluginWDTDriverHandoff;
+    } else {
+        d->wdtNoUpgrade = true;
+    }
+
+    size_t keySize = strlen(file) + (args ? strlen(args) : 0) + 2;
+    c->key = (char*)malloc(keySize);
+    if(!c->key) goto failed;
+    snprintf(c->key, keySize, "%s:%s", file, args ? args : "");
+
+    /* Take over the descriptor of a previous instance */
+    unsigned int interval = 0;
+    int fd = PLUGIN_HAS(c->plugin, resume) ? handoffTake('d', c->key, NULL) : -1;
+    if(fd >= 0) {
+        c->pluginContext = c->plugin->resume(args ? args : "", fd, &interval);
+        if(!c->pluginContext) {
+            close(fd);
+            goto failed;
+        }
+    } else {
+        c->pluginContext = c->plugin->open(args ? args : "", &interval);
+        if(!c->pluginContext) goto failed;
+    }
+
+    /* Kick at half the hardware timeout, like the other drivers */
+    d->wdtMaxIntervalSeconds = interval / 2;
+    if(!d->wdtMaxIntervalSeconds) {
+        d->wdtMaxIntervalSeconds = 1;
+    }
+    c->healthy = true;
+
+    return d;
+
+failed:
+    wdtDriverFree(d);
+    return NULL;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../project.h"
+#include <netdb.h>
+
+/* Uplink: kicks a channel of a remote MahiWDT while this node is healthy */
+struct udpWDTContext {
+    int fd;
+    char* name;
+
+    WDTHmac key;
+    uint64_t counter;
+};
+
+static void udpWDTDriverFree(void* context)
+{
+    struct udpWDTContext* c = (struct udpWDTContext*)context;
+
+    if(c) {
+        if(c->fd >= 0) {
+            close(c->fd);
+        }
+        if(c->name) {
+            free(c->name);
+        }
+
+        memset(c, 0, sizeof(*c));
+        free(c);
+    }
+}
+
+static void udpWDTDriverKick(void* context)
+{
+    struct udpWDTContext* c = (struct udpWDTContext*)context;
+
+    /* Realtime based so the receiver accepts us again after a restart */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    uint64_t counter = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    if(counter <= c->counter) {
+        counter = c->counter + 1;
+    }
+    c->counter = counter;
+
+    uint8_t buf[512];
+    size_t len = udpMessageBuild(buf, sizeof(buf), c->name, WDT_MSG_KICK, counter, &c->key);
+    if(!len) return;
+
+    /* Failure is harmless, the remote side times out */
+    send(c->fd, buf, len, MSG_DONTWAIT);
+}
+
+WDTHWDriver* udpWDTDriverNew(const char* host, const char* service, const char* name, const char* keyFile, unsigned int interval)
+{
+    WDTHWDriver* d = (WDTHWDriver*)calloc(1, sizeof(WDTHWDriver));
+    if(!d) return NULL;
+
+    struct udpWDTContext* c = calloc(1, sizeof(struct udpWDTContext));
+    if(!c) goto failed;
+
+    d->wdtContext = c;
+    d->wdtFreeFunc = udpWDTDriverFree;
+    d->wdtKickFunc = udpWDTDriverKick;
+    d->wdtMaxIntervalSeconds = interval;
+
+    c->fd = -1;
+
+    if(strlen(name) > 255) {
+        errno = EINVAL;
+        goto failed;
+    }
+
+    c->name = strdup(name);
+    if(!c->name) goto failed;
+
+    if(!udpKeyLoad(keyFile, &c->key)) goto failed;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if(getaddrinfo(host, service, &hints, &res)) {
+        errno = EINVAL;
+        goto failed;
+    }
+
+    c->fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(c->fd < 0 || connect(c->fd, res->ai_addr, res->ai_addrlen)) {
+        int err = errno;
+        freeaddrinfo(res);
+        errno = err;
+        goto failed;
+    }
+
+    freeaddrinfo(res);
+
+    return d;
+
+failed:
+    wdtDriverFree(d);
+    return NULL;
+}
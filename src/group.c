@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "project.h"
+
+WDTGroup* groupNew(const char* name, uint32_t minAlive)
+{
+    WDTGroup* group = (WDTGroup*)calloc(1, sizeof(WDTGroup));
+    if(!group) return NULL;
+
+    group->name = strdup(name);
+    if(!group->name) {
+        free(group);
+        return NULL;
+    }
+
+    group->minAlive = minAlive;
+
+    return group;
+}
+
+void groupFree(WDTGroup* group)
+{
+    if(!group) return;
+
+    free(group->name);
+    free(group);
+}
+
+void groupAddPort(WDTGroup* group, WDTPort* port)
+{
+    port->group = group;
+
+    group->members++;
+    if(port->alive) {
+        group->alive++;
+    }
+}
+
+void groupPortUp(WDTGroup* group)
+{
+    group->alive++;
+}
+
+bool groupPortDown(WDTGroup* group)
+{
+    group->alive--;
+
+    if(group->alive < group->minAlive) {
+        fprintf(stderr, "Watchdog quorum lost in group %s (%u of %u alive, %u required)\n",
+                group->name, group->alive, group->members, group->minAlive);
+        return false;
+    }
+
+    return true;
+}
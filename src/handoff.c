@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include "project.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Environment variable carrying the descriptor of the serialized state */
+#define HANDOFF_ENV "MAHIWDT_HANDOFF_FD"
+
+/* Socket activation, see sd_listen_fds(3) */
+#define HANDOFF_LISTEN_FDS_START 3
+
+typedef struct HandoffEntry {
+    char type;
+    int fd;
+    uint64_t value;
+    char* key;
+
+    /* Socket activation file descriptor name, matched like the key */
+    char* alias;
+
+    struct HandoffEntry* next;
+} HandoffEntry;
+
+static HandoffEntry* handoffList = NULL;
+
+bool handoffLoad()
+{
+    char* env = getenv(HANDOFF_ENV);
+    if(!env) return false;
+
+    int fd = atoi(env);
+    unsetenv(HANDOFF_ENV);
+
+    FILE* f = fdopen(fd, "r");
+    if(!f) {
+        close(fd);
+        return false;
+    }
+
+    char line[512];
+    while(fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+
+        char type;
+        int entryFd, keyOffset = 0;
+        unsigned long long value;
+
+        if(sscanf(line, "%c %d %llu %n", &type, &entryFd, &value, &keyOffset) < 3 || !keyOffset) {
+            continue;
+        }
+
+        HandoffEntry* e = (HandoffEntry*)calloc(1, sizeof(HandoffEntry));
+        if(!e) break;
+
+        e->type = type;
+        e->fd = entryFd;
+        e->value = value;
+        e->key = strdup(line + keyOffset);
+        if(!e->key) {
+            free(e);
+            break;
+        }
+
+        /* Do not leak inherited descriptors into commands we run */
+        if(e->fd >= 0) {
+            fcntl(e->fd, F_SETFD, FD_CLOEXEC);
+        }
+
+        e->next = handoffList;
+        handoffList = e;
+    }
+
+    fclose(f);
+
+    return true;
+}
+
+void handoffActivation()
+{
+    char* pid = getenv("LISTEN_PID");
+    char* fds = getenv("LISTEN_FDS");
+    char* names = getenv("LISTEN_FDNAMES");
+
+    if(!pid || !fds || atoi(pid) != getpid()) goto done;
+
+    char* namesCopy = names ? strdup(names) : NULL;
+    char* save = NULL;
+    char* name = namesCopy ? strtok_r(namesCopy, ":", &save) : NULL;
+
+    for(int i=0; i<atoi(fds); i++, name = name ? strtok_r(NULL, ":", &save) : NULL) {
+        int fd = HANDOFF_LISTEN_FDS_START + i;
+
+        /* Do not leak them into commands we run */
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        int type;
+        socklen_t len = sizeof(type);
+        struct sockaddr_un addr;
+        socklen_t addrLen = sizeof(addr) - 1;
+
+        memset(&addr, 0, sizeof(addr));
+        if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) || type != SOCK_DGRAM ||
+           getsockname(fd, (struct sockaddr*)&addr, &addrLen) || addr.sun_family != AF_UNIX) {
+            fprintf(stderr, "Ignoring activated descriptor %d, not a unix datagram socket\n", fd);
+            close(fd);
+            continue;
+        }
+
+        /* Abstract and unnamed sockets can only be matched by name */
+        const char* key = addr.sun_path[0] ? addr.sun_path : name;
+        if(!key) {
+            close(fd);
+            continue;
+        }
+
+        HandoffEntry* e = (HandoffEntry*)calloc(1, sizeof(HandoffEntry));
+        if(!e) {
+            close(fd);
+            break;
+        }
+
+        e->type = 'a';
+        e->fd = fd;
+        e->key = strdup(key);
+        e->alias = name ? strdup(name) : NULL;
+
+        e->next = handoffList;
+        handoffList = e;
+    }
+
+    free(namesCopy);
+
+done:
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+}
+
+static void handoffEntryFree(HandoffEntry* entry)
+{
+    free(entry->key);
+    free(entry->alias);
+    free(entry);
+}
+
+static HandoffEntry* handoffFind(char type, const char* key)
+{
+    for(HandoffEntry** e = &handoffList; *e; e = &(*e)->next) {
+        HandoffEntry* entry = *e;
+
+        /* Entries without a key could not be allocated, they are only released */
+        if(entry->type != type || !entry->key) continue;
+
+        if(!strcmp(entry->key, key) || (entry->alias && !strcmp(entry->alias, key))) {
+            *e = entry->next;
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+int handoffTake(char type, const char* key, uint64_t* value)
+{
+    HandoffEntry* entry = handoffFind(type, key);
+    if(!entry) return -1;
+
+    int fd = entry->fd;
+    if(value) *value = entry->value;
+
+    handoffEntryFree(entry);
+
+    return fd;
+}
+
+bool handoffTakeValue(char type, const char* key, uint64_t* value)
+{
+    HandoffEntry* entry = handoffFind(type, key);
+    if(!entry) return false;
+
+    *value = entry->value;
+
+    handoffEntryFree(entry);
+
+    return true;
+}
+
+void handoffRelease()
+{
+    /* Whatever is left is no longer part of the configuration */
+    while(handoffList) {
+        HandoffEntry* entry = handoffList;
+        handoffList = entry->next;
+
+        if(entry->fd >= 0) {
+            close(entry->fd);
+        }
+        if(entry->type == 'p') {
+            unlink(entry->key);
+        }
+
+        /* The command of a removed domain, do not leave it unreaped */
+        if(entry->type == 'P') {
+            pid_t pid = entry->value;
+            if(waitpid(pid, NULL, WNOHANG) == 0) {
+                kill(-pid, SIGKILL);
+                while(waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+            }
+        }
+
+        /* Not ours to unlink */
+        if(entry->type == 'a') {
+            fprintf(stderr, "Activated socket %s matches no channel\n", entry->key ? entry->key : "?");
+        }
+
+        handoffEntryFree(entry);
+    }
+}
+
+/* After a failed exec, children we spawn later must not inherit the handed over descriptors */
+static void handoffRestoreCloexec(WDTSystem* s)
+{
+    for(WDTPort* port = s->port; port; port=port->next) {
+        if(port->fd >= 0) {
+            fcntl(port->fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    for(WDTListener* l = s->listener; l; l=l->next) {
+        fcntl(l->fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+        const char* key;
+        int driverFd = wdtDriverHandoff(driver, &key);
+
+        if(driverFd >= 0) {
+            fcntl(driverFd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+}
+
+bool handoffExec(WDTSystem* s, char** argv)
+{
+    for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+        if(driver->wdtNoUpgrade) {
+            fprintf(stderr, "A watchdog driver cannot be handed over to a new instance\n");
+            errno = ENOTSUP;
+            return false;
+        }
+    }
+
+    int fd = memfd_create("mahiwdt-handoff", 0);
+    if(fd < 0) return false;
+
+    for(WDTPort* port = s->port; port; port=port->next) {
+        /* Dead ports are passed as already expired */
+        unsigned long long expirySeconds = port->alive ? port->expirySeconds : 0;
+
+        if(port->remote) {
+            dprintf(fd, "r -1 %llu %s\n", expirySeconds, port->name);
+            dprintf(fd, "c -1 %llu %s\n", (unsigned long long)port->remote->lastCounter, port->name);
+            continue;
+        }
+
+        /* Only the OOM kill baseline, the inotify watches are set up again */
+        if(port->cgroup) {
+            if(port->cgroup->oomKills >= 0) {
+                dprintf(fd, "o -1 %lld %s\n", (long long)port->cgroup->oomKills, port->name);
+            }
+            continue;
+        }
+
+        if(port->check) {
+            dprintf(fd, "h -1 %llu %s\n", expirySeconds, port->name);
+            continue;
+        }
+
+        /* Activated sockets stay unowned, 0 would read as not armed yet */
+        if(port->activated) {
+            fcntl(port->fd, F_SETFD, 0);
+            dprintf(fd, "a %d %llu %s\n", port->fd, expirySeconds ? expirySeconds : 1, port->laddr.sun_path);
+            continue;
+        }
+
+        if(port->fd < 0 || !port->bound) continue;
+
+        fcntl(port->fd, F_SETFD, 0);
+        dprintf(fd, "p %d %llu %s\n", port->fd, expirySeconds, port->laddr.sun_path);
+    }
+
+    for(WDTDomain* domain = s->domain; domain; domain=domain->next) {
+        dprintf(fd, "D -1 %d %s\n", domain->failed, domain->name);
+
+        if(domain->commandPid > 0) {
+            dprintf(fd, "P -1 %d %s\n", (int)domain->commandPid, domain->name);
+        }
+    }
+
+    for(WDTListener* l = s->listener; l; l=l->next) {
+        fcntl(l->fd, F_SETFD, 0);
+        dprintf(fd, "l %d 0 %s\n", l->fd, l->address);
+    }
+
+    for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+        const char* key;
+        int driverFd = wdtDriverHandoff(driver, &key);
+
+        if(driverFd >= 0) {
+            fcntl(driverFd, F_SETFD, 0);
+            dprintf(fd, "d %d 0 %s\n", driverFd, key);
+        }
+    }
+
+    /* The new instance reads from the start, the file offset is shared */
+    lseek(fd, 0, SEEK_SET);
+
+    char env[16];
+    snprintf(env, sizeof(env), "%d", fd);
+    setenv(HANDOFF_ENV, env, 1);
+
+    /* Give the new instance a full interval to start up */
+    for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+        if(driver->domain && driver->domain->failed) continue;
+        wdtDriverKickSync(driver);
+    }
+
+    printf("Upgrading: %s\n", argv[0]);
+    fflush(stdout);
+    fflush(stderr);
+
+    /* The mask survives exec, the new image unblocks once its handler is in place */
+    sigset_t upgradeMask;
+    sigemptyset(&upgradeMask);
+    sigaddset(&upgradeMask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &upgradeMask, NULL);
+
+    execvp(argv[0], argv);
+
+    int err = errno;
+    sigprocmask(SIG_UNBLOCK, &upgradeMask, NULL);
+    handoffRestoreCloexec(s);
+    unsetenv(HANDOFF_ENV);
+    close(fd);
+    errno = err;
+
+    return false;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "project.h"
+
+/* Bucket 0 holds zero, bucket i holds [2^(i-1), 2^i) */
+static unsigned int histogramBucket(uint64_t value)
+{
+    unsigned int bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+    if(bucket >= WDT_HISTOGRAM_BUCKETS) {
+        bucket = WDT_HISTOGRAM_BUCKETS - 1;
+    }
+
+    return bucket;
+}
+
+void histogramAdd(WDTHistogram* h, uint64_t value)
+{
+    h->count[histogramBucket(value)]++;
+
+    if(!h->samples || value < h->min) {
+        h->min = value;
+    }
+    if(value > h->max) {
+        h->max = value;
+    }
+
+    h->samples++;
+}
+
+void histogramPrint(const WDTHistogram* h, FILE* f, const char* name, const char* unit)
+{
+    fprintf(f, "%s: %llu samples", name, (unsigned long long)h->samples);
+
+    if(!h->samples) {
+        fprintf(f, "\n");
+        return;
+    }
+
+    fprintf(f, ", min %llu%s, max %llu%s\n", (unsigned long long)h->min, unit, (unsigned long long)h->max, unit);
+
+    for(unsigned int i=0; i<WDT_HISTOGRAM_BUCKETS; i++) {
+        if(!h->count[i]) continue;
+
+        uint64_t low = i ? 1ULL << (i - 1) : 0;
+        fprintf(f, "  >= %llu%s: %llu\n", (unsigned long long)low, unit, (unsigned long long)h->count[i]);
+    }
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "project.h"
+
+/* Minimal SHA-256 (FIPS 180-4) and HMAC (RFC 2104) for heartbeat authentication */
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Block(WDTSha256* c, const uint8_t* p)
+{
+    uint32_t w[64];
+
+    for(int i=0; i<16; i++) {
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    }
+
+    for(int i=16; i<64; i++) {
+        uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = c->h[0], b = c->h[1], d = c->h[3], e = c->h[4];
+    uint32_t cc = c->h[2], f = c->h[5], g = c->h[6], h = c->h[7];
+
+    for(int i=0; i<64; i++) {
+        uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = cc;
+        cc = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    c->h[0] += a;
+    c->h[1] += b;
+    c->h[2] += cc;
+    c->h[3] += d;
+    c->h[4] += e;
+    c->h[5] += f;
+    c->h[6] += g;
+    c->h[7] += h;
+}
+
+void sha256Init(WDTSha256* c)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(c->h, iv, sizeof(iv));
+    c->length = 0;
+    c->bufLen = 0;
+}
+
+void sha256Update(WDTSha256* c, const uint8_t* data, size_t len)
+{
+    c->length += len;
+
+    while(len) {
+        if(!c->bufLen && len >= 64) {
+            sha256Block(c, data);
+            data += 64;
+            len -= 64;
+            continue;
+        }
+
+        size_t chunk = 64 - c->bufLen;
+        if(chunk > len) chunk = len;
+
+        memcpy(c->buf + c->bufLen, data, chunk);
+        c->bufLen += chunk;
+        data += chunk;
+        len -= chunk;
+
+        if(c->bufLen == 64) {
+            sha256Block(c, c->buf);
+            c->bufLen = 0;
+        }
+    }
+}
+
+void sha256Final(WDTSha256* c, uint8_t* digest)
+{
+    uint64_t bits = c->length * 8;
+
+    c->buf[c->bufLen++] = 0x80;
+    if(c->bufLen > 56) {
+        memset(c->buf + c->bufLen, 0, 64 - c->bufLen);
+        sha256Block(c, c->buf);
+        c->bufLen = 0;
+    }
+    memset(c->buf + c->bufLen, 0, 56 - c->bufLen);
+
+    for(int i=0; i<8; i++) {
+        c->buf[56 + i] = bits >> (56 - 8*i);
+    }
+    sha256Block(c, c->buf);
+
+    for(int i=0; i<8; i++) {
+        digest[4*i] = c->h[i] >> 24;
+        digest[4*i+1] = c->h[i] >> 16;
+        digest[4*i+2] = c->h[i] >> 8;
+        digest[4*i+3] = c->h[i];
+    }
+}
+
+void hmacInit(WDTHmac* h, const uint8_t* key, size_t keyLen)
+{
+    uint8_t block[64];
+    memset(block, 0, sizeof(block));
+
+    /* Long keys are hashed first */
+    if(keyLen > sizeof(block)) {
+        WDTSha256 c;
+        sha256Init(&c);
+        sha256Update(&c, key, keyLen);
+        sha256Final(&c, block);
+    } else {
+        memcpy(block, key, keyLen);
+    }
+
+    /* Precompute the padded key states, this halves the work per message */
+    for(int i=0; i<64; i++) block[i] ^= 0x36;
+    sha256Init(&h->inner);
+    sha256Update(&h->inner, block, sizeof(block));
+
+    for(int i=0; i<64; i++) block[i] ^= 0x36 ^ 0x5c;
+    sha256Init(&h->outer);
+    sha256Update(&h->outer, block, sizeof(block));
+
+    memset(block, 0, sizeof(block));
+}
+
+void hmacCompute(const WDTHmac* h, const uint8_t* data, size_t len, uint8_t* mac)
+{
+    WDTSha256 c = h->inner;
+    sha256Update(&c, data, len);
+    sha256Final(&c, mac);
+
+    c = h->outer;
+    sha256Update(&c, mac, WDT_HMAC_SIZE);
+    sha256Final(&c, mac);
+}
+
+bool hmacVerify(const WDTHmac* h, const uint8_t* data, size_t len, const uint8_t* mac)
+{
+    uint8_t expected[WDT_HMAC_SIZE];
+    hmacCompute(h, data, len, expected);
+
+    /* Constant time compare */
+    uint8_t diff = 0;
+    for(int i=0; i<WDT_HMAC_SIZE; i++) {
+        diff |= expected[i] ^ mac[i];
+    }
+
+    return diff == 0;
+}
@@ -30,17 +30,90 @@
 
 void wdtDriverKick(WDTHWDriver* driver)
 {
-    if(driver && driver->wdtKickFunc) {
+    if(!driver) return;
+
+    if(driver->wdtKickStartFunc) {
+        /* The previous kick has not completed yet */
+        if(driver->wdtKickPending) {
+            driver->wdtKickOverruns++;
+            return;
+        }
+
+        int fd = driver->wdtKickStartFunc(driver->wdtContext);
+        if(fd >= 0) {
+            driver->wdtKickPending = true;
+            driver->wdtKickFd = fd;
+        }
+    } else if(driver->wdtKickFunc) {
         driver->wdtKickFunc(driver->wdtContext);
     }
 }
 
+void wdtDriverKickFinish(WDTHWDriver* driver)
+{
+    if(driver && driver->wdtKickPending) {
+        driver->wdtKickPending = false;
+        if(driver->wdtKickFinishFunc) {
+            driver->wdtKickFinishFunc(driver->wdtContext);
+        }
+    }
+}
+
+static bool wdtDriverKickReady(WDTHWDriver* driver, int timeoutMs)
+{
+    struct pollfd fd = { .fd = driver->wdtKickFd, .events = POLLIN };
+
+    return poll(&fd, 1, timeoutMs) > 0 && (fd.revents & POLLIN);
+}
+
+void wdtDriverKickSync(WDTHWDriver* driver)
+{
+    wdtDriverKick(driver);
+
+    if(driver && driver->wdtKickPending) {
+        /* Outside the event loop, wait for the completion here */
+        if(wdtDriverKickReady(driver, 1000)) {
+            wdtDriverKickFinish(driver);
+        } else {
+            /* Still in flight, finished later or cancelled by the driver on free */
+            driver->wdtKickTimeouts++;
+        }
+    }
+}
+
 void wdtDriverFree(WDTHWDriver* driver)
 {
     if(driver) {
+        /* A kick still in flight is cancelled by the free function */
+        if(driver->wdtKickPending && wdtDriverKickReady(driver, 0)) {
+            wdtDriverKickFinish(driver);
+        }
+        driver->wdtKickPending = false;
+
         if(driver->wdtFreeFunc) {
             driver->wdtFreeFunc(driver->wdtContext);
         }
         free(driver);
     }
 }
+
+int wdtDriverHandoff(WDTHWDriver* driver, const char** key)
+{
+    if(driver && driver->wdtHandoffFunc) {
+        return driver->wdtHandoffFunc(driver->wdtContext, key);
+    }
+
+    return -1;
+}
+
+void wdtDriverStatus(WDTHWDriver* driver, FILE* f)
+{
+    if(driver && driver->wdtStatusFunc) {
+        driver->wdtStatusFunc(driver->wdtContext, f);
+    }
+
+    if(driver && driver->wdtKickStartFunc) {
+        fprintf(f, "  Asynchronous kicks: %s, %llu overruns, %llu timeouts\n", driver->wdtKickPending ? "pending" : "idle",
+                (unsigned long long)driver->wdtKickOverruns, (unsigned long long)driver->wdtKickTimeouts);
+    }
+}
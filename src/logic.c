@@ -25,25 +25,224 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include "project.h"
 
-bool logicRun(WDTSystem* s, volatile bool* die)
+/* Maximum number of heartbeats taken from a UDP listener per wakeup */
+#define UDP_RX_BATCH 64
+
+/* Datagrams taken from a channel per wakeup, and at most drained from a rate limited one */
+#define PORT_RX_BATCH 16
+#define PORT_DRAIN_MAX 1024
+
+/* At most one lag warning per interval, all of them are counted */
+#define LOGIC_LAG_WARN_INTERVAL_NS (60 * 1000000000ULL)
+
+bool logicPortMessage(WDTPort* port, int msg)
+{
+    /* Errors are never rate limited */
+    if(msg == WDT_MSG_ERROR) {
+        fprintf(stderr, "Watchdog ERROR on channel %s\n", port->name);
+        return portExpire(port);
+    }
+
+    if(!portAdmit(port)) {
+        return true;
+    }
+
+    if(msg == WDT_MSG_KICK) {
+        portKick(port, false);
+    }
+
+    return true;
+}
+
+bool logicPortReady(WDTPort* port)
+{
+    if(port->cgroup) {
+        if(!cgroupCheck(port)) {
+            fprintf(stderr, "Watchdog event on channel %s\n", port->name);
+            return portExpire(port);
+        }
+
+        return true;
+    }
+
+    uint8_t rxBuf[PORT_RX_BATCH][16];
+    struct iovec iov[PORT_RX_BATCH];
+    struct mmsghdr msgs[PORT_RX_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for(unsigned int i=0; i<PORT_RX_BATCH; i++) {
+        iov[i].iov_base = rxBuf[i];
+        iov[i].iov_len = sizeof(rxBuf[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* One batch per wakeup, keep draining a flooding channel so it does not keep poll busy */
+    unsigned int received = 0;
+    do {
+        int n = recvmmsg(port->fd, msgs, PORT_RX_BATCH, MSG_DONTWAIT, NULL);
+        if(n < 0) {
+            return errno == EINTR || errno == EAGAIN;
+        }
+
+        for(int i=0; i<n; i++) {
+            if(!logicPortMessage(port, portParseMessage(rxBuf[i], msgs[i].msg_len))) {
+                return false;
+            }
+        }
+
+        received += n;
+        if(n < PORT_RX_BATCH) break;
+    } while(port->rateLimited && received < PORT_DRAIN_MAX);
+
+    return true;
+}
+
+bool logicListenerReady(WDTListener* l)
+{
+    WDTPort* port;
+    int msg;
+
+    /* Bounded, so a flood cannot starve the other channels */
+    for(unsigned int n=0; n<UDP_RX_BATCH && (msg = udpReceive(l, &port)) >= 0; n++) {
+        if(msg != WDT_MSG_NONE && !logicPortMessage(port, msg)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool logicCheckReady(WDTPort* port)
+{
+    if(checkReap(port)) {
+        return logicPortMessage(port, WDT_MSG_KICK);
+    }
+
+    return true;
+}
+
+static void logicIterationDone(WDTSystem* s, uint64_t startNs, uint64_t waitNs, uint64_t plannedNs, uint64_t wokeNs)
+{
+    uint64_t endNs = utilGetMonotonicNs();
+
+    histogramAdd(&s->loop.dispatch, (endNs - wokeNs) / 1000);
+    histogramAdd(&s->loop.iteration, (endNs - startNs - (wokeNs - waitNs)) / 1000);
+
+    /* Only wakeups from the timeout say something about our own latency */
+    if(wokeNs < plannedNs) return;
+
+    uint64_t lagUs = (wokeNs - plannedNs) / 1000;
+    histogramAdd(&s->loop.wakeLag, lagUs);
+
+    /* Warn once half of the margin between hardware kicks is gone */
+    if(lagUs * 2 >= s->loop.kickMarginSeconds * 1000000ULL) {
+        s->loop.lagWarnings++;
+
+        if(!s->loop.lagWarnedNs || wokeNs >= s->loop.lagWarnedNs + LOGIC_LAG_WARN_INTERVAL_NS) {
+            s->loop.lagWarnedNs = wokeNs;
+            fprintf(stderr, "Event loop woke %lluus late, kick margin is %llus (%llu late wakeups)\n",
+                    (unsigned long long)lagUs, (unsigned long long)s->loop.kickMarginSeconds,
+                    (unsigned long long)s->loop.lagWarnings);
+        }
+    }
+}
+
+bool logicPressureReady(WDTPort* port, int fd)
+{
+    if(!cgroupPressureReady(port, fd)) {
+        return portExpire(port);
+    }
+
+    return true;
+}
+
+bool logicRun(WDTSystem* s, volatile bool* die, volatile bool* dumpStatus)
 {
     unsigned int numPorts=0;
     for(WDTPort* port = s->port; port; port=port->next) {
-        portKick(port, true);
+        /* Keep the deadlines handed over by a previous instance, cgroup channels start from their state */
+        if(!s->resumed && !port->cgroup) {
+            portKick(port, true);
+        }
         numPorts++;
     }
 
-    struct pollfd fds[numPorts];
-    unsigned int i=0;
+    unsigned int numListeners=0;
+    for(WDTListener* l = s->listener; l; l=l->next) {
+        numListeners++;
+    }
+
+    unsigned int numDrivers=0;
+    for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+        numDrivers++;
+    }
+
+    unsigned int numChecks=0;
+    unsigned int numPressure=0;
     for(WDTPort* port = s->port; port; port=port->next) {
+        if(port->check) numChecks++;
+
+        for(int r=0; port->cgroup && r<WDT_CGROUP_PRESSURE_MAX; r++) {
+            if(port->cgroup->pressureFd[r] >= 0) numPressure++;
+        }
+    }
+
+    WDTUring* uring = NULL;
+    if(s->useUring) {
+        uring = uringNew(s);
+        if(!uring) {
+            fprintf(stderr, "io_uring unavailable (errno=%s), using poll\n", strerror(errno));
+        }
+    }
+
+    /* Ports without a socket (remote channels) have fd -1 and are skipped by poll */
+    unsigned int numFds = uring ? 0 : numPorts + numListeners + numDrivers + numChecks + numPressure;
+    struct pollfd fds[numFds + 1];
+    WDTPort* ports[numPorts + 1];
+    WDTPort* checkPorts[numChecks + 1];
+    WDTPort* pressurePorts[numPressure + 1];
+    unsigned int roundRobin = 0;
+    unsigned int i=0;
+    for(WDTPort* port = s->port; port && !uring; port=port->next) {
+        ports[i] = port;
         fds[i].fd = port->fd;
         fds[i].events = POLLIN;
         i++;
     }
+    for(WDTListener* l = s->listener; l && !uring; l=l->next) {
+        fds[i].fd = l->fd;
+        fds[i].events = POLLIN;
+        i++;
+    }
+    for(WDTHWDriver* driver = s->wdtDriver; driver && !uring; driver=driver->next) {
+        fds[i].fd = -1;
+        fds[i].events = POLLIN;
+        i++;
+    }
+    numChecks = 0;
+    for(WDTPort* port = s->port; port && !uring; port=port->next) {
+        if(!port->check) continue;
+        checkPorts[numChecks++] = port;
+        fds[i].fd = -1;
+        fds[i].events = POLLIN;
+        i++;
+    }
+    unsigned int pressureStart = i;
+    for(WDTPort* port = s->port; port && !uring; port=port->next) {
+        for(int r=0; port->cgroup && r<WDT_CGROUP_PRESSURE_MAX; r++) {
+            if(port->cgroup->pressureFd[r] < 0) continue;
+            pressurePorts[i - pressureStart] = port;
+            fds[i].fd = port->cgroup->pressureFd[r];
+            fds[i].events = POLLPRI;
+            i++;
+        }
+    }
 
-    uint8_t rxBuf[16];
+    bool cleanExit = true;
     uint64_t hwDriverNextKick = 0;
     uint64_t hwDriverMinimumIncrement = -1ULL;
 
@@ -52,8 +251,19 @@ bool logicRun(WDTSystem* s, volatile bool* die)
             hwDriverMinimumIncrement = driver->wdtMaxIntervalSeconds;
         }
     }
+    s->loop.kickMarginSeconds = hwDriverMinimumIncrement;
 
     while(!*die) {
+        uint64_t startNs = utilGetMonotonicNs();
+
+        if(*dumpStatus) {
+            *dumpStatus = false;
+            statusDump(s, stdout);
+        }
+
+        /* Reap domain commands and re-arm failed domains */
+        domainRun(s);
+
         /* Calculate timeout */
         uint64_t earliest = -1ULL;
         WDTPort* earlyPort = NULL;
@@ -68,66 +278,150 @@ bool logicRun(WDTSystem* s, volatile bool* die)
         struct timespec now;
         clock_gettime(CLOCK_MONOTONIC, &now);
         if(earliest <= now.tv_sec) {
-            fprintf(stderr, "Watchdog timeout on channel %s\n", earlyPort->laddr.sun_path);
-            return false;
+            fprintf(stderr, "Watchdog timeout on channel %s\n", earlyPort->name);
+            if(!portExpire(earlyPort)) {
+                cleanExit = false;
+                break;
+            }
+
+            /* Quorum still holds, look for the next deadline */
+            continue;
         }
 
         if(hwDriverNextKick <= now.tv_sec) {
             /* Check if we need to put the system up flag */
-            if(s->uptimeNotificationSeconds) {
+            if(s->uptimeNotificationSeconds || s->bootStableSeconds) {
                 uint64_t uptime = utilGetUptimeSeconds();
-                if(uptime >= s->uptimeNotificationSeconds) {
+                if(s->uptimeNotificationSeconds && uptime >= s->uptimeNotificationSeconds) {
                     s->uptimeNotificationSeconds = 0;
                     int fd = open(s->uptimeNotificationFile, O_RDWR | O_CREAT, 0644);
                     if(fd >= 0) close(fd);
                 }
+
+                /* Stayed up long enough, this boot does not count towards a boot loop */
+                if(s->bootStableSeconds && uptime >= s->bootStableSeconds) {
+                    s->bootStableSeconds = 0;
+                    bootLoopStable(s);
+                }
             }
 
             /* Kick the HW wdt */
+            uint64_t kickNs = utilGetMonotonicNs();
             for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+                /* Let the hardware watchdog of a failed domain expire */
+                if(driver->domain && driver->domain->failed) continue;
+
                 wdtDriverKick(driver);
             }
+            histogramAdd(&s->loop.driverKick, (utilGetMonotonicNs() - kickNs) / 1000);
 
             hwDriverNextKick = now.tv_sec + hwDriverMinimumIncrement;
         }
 
+        /* Start due health checks and stop overrunning ones */
+        uint64_t checkNext = checkRun(s, now.tv_sec);
+        if(earliest > checkNext) {
+            earliest = checkNext;
+        }
+
         /* Limit timeout to max hw WDT delay */
         if(earliest > hwDriverNextKick) {
             earliest = hwDriverNextKick;
         }
 
-        /* Make timeout relative */
-        earliest -= now.tv_sec;
+        /* Sleep until the absolute deadline, not a whole number of seconds from now */
+        uint64_t plannedNs = earliest * 1000000000ULL;
+        uint64_t waitNs = utilGetMonotonicNs();
+        uint64_t timeoutNs = plannedNs > waitNs ? plannedNs - waitNs : 0;
+        uint64_t wokeNs;
+
+        if(uring) {
+            if(!uringWait(uring, timeoutNs, &wokeNs)) {
+                cleanExit = false;
+                break;
+            }
+            logicIterationDone(s, startNs, waitNs, plannedNs, wokeNs);
+            continue;
+        }
+
+        /* Wait for asynchronous driver kicks in flight */
+        i = numPorts + numListeners;
+        for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+            fds[i++].fd = driver->wdtKickPending ? driver->wdtKickFd : -1;
+        }
+
+        /* Wait for running health checks to exit */
+        for(unsigned int n=0; n<numChecks; n++) {
+            fds[i++].fd = checkPorts[n]->check->pidFd;
+        }
 
-        int retVal = poll(fds, numPorts, earliest * 1000);
+        struct timespec timeout = {
+            .tv_sec = timeoutNs / 1000000000ULL,
+            .tv_nsec = timeoutNs % 1000000000ULL
+        };
+        int retVal = ppoll(fds, numFds, &timeout, NULL);
+        wokeNs = utilGetMonotonicNs();
         if(retVal < 0) {
             if(errno != EINTR) {
-                return false;
+                cleanExit = false;
+                break;
             }
         } else if(retVal) {
-            for(unsigned int i=0; i<numPorts; i++) {
-                i=0;
-                for(WDTPort* port = s->port; port; port=port->next) {
-                    if(fds[i].revents & POLLIN) {
-                        struct sockaddr_un raddr;
-                        socklen_t len = sizeof(raddr);
-                        ssize_t recvLen = recvfrom(port->fd, rxBuf, sizeof(rxBuf), 0, (struct sockaddr*)&raddr, &len);
-                        if(recvLen < 0) {
-                            if(errno != EINTR) {
-                                return false;
-                            }
-                        } else if(recvLen == 4 && memcmp(rxBuf, "KICK", 4) == 0) {
-                            portKick(port, false);
-                        } else if(recvLen == 5 && memcmp(rxBuf, "ERROR", 5) == 0) {
-                            fprintf(stderr, "Watchdog ERROR on channel %s\n", port->laddr.sun_path);
-                            return false;
-                        }
-                    }
-                    i++;
+            /* Rotate the starting channel so none is consistently served last */
+            for(unsigned int n=0; n<numPorts && cleanExit; n++) {
+                i = (roundRobin + n) % numPorts;
+                WDTPort* port = ports[i];
+                short revents = fds[i].revents;
+
+                /* Cgroup channels also wake on POLLPRI/POLLERR */
+                if(port->cgroup ? revents : (revents & POLLIN)) {
+                    cleanExit = logicPortReady(port);
+                }
+            }
+            roundRobin++;
+
+            i = numPorts;
+            for(WDTListener* l = s->listener; l && cleanExit; l=l->next) {
+                if(fds[i++].revents & POLLIN) {
+                    cleanExit = logicListenerReady(l);
+                }
+            }
+
+            if(!cleanExit) break;
+
+            for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+                if(fds[i++].revents) {
+                    wdtDriverKickFinish(driver);
+                }
+            }
+
+            for(unsigned int n=0; n<numChecks && cleanExit; n++) {
+                if(fds[i++].revents) {
+                    cleanExit = logicCheckReady(checkPorts[n]);
+                }
+            }
+
+            for(unsigned int n=0; n<numPressure && cleanExit; n++, i++) {
+                if(fds[i].revents) {
+                    cleanExit = logicPressureReady(pressurePorts[n], fds[i].fd);
+                }
+
+                /* Trigger is gone with its cgroup, stop polling it */
+                if(fds[i].revents & (POLLERR | POLLNVAL)) {
+                    fds[i].fd = -1;
                 }
             }
         }
+
+        logicIterationDone(s, startNs, waitNs, plannedNs, wokeNs);
     }
 
-    return true;
+    uringFree(uring);
+
+    /* Do not leave children behind for an upgraded instance */
+    for(WDTPort* port = s->port; port; port=port->next) {
+        if(port->check) checkStop(port);
+    }
+
+    return cleanExit;
 }
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+#ifndef SRC_MAHIWDT_PLUGIN_H_
+#define SRC_MAHIWDT_PLUGIN_H_
+
+/*
+ * Hardware watchdog driver plugin ABI.
+ *
+ * A plugin is a shared object exporting a MahiWDTPlugin structure named
+ * MAHIWDT_PLUGIN_SYMBOL. It is loaded with -w plugin:<file.so>[:<args>].
+ * New hooks are only ever appended, the daemon checks size before using one.
+ */
+#define MAHIWDT_PLUGIN_ABI_VERSION 1
+#define MAHIWDT_PLUGIN_SYMBOL "mahiwdtPlugin"
+
+typedef struct MahiWDTPlugin {
+    /* MAHIWDT_PLUGIN_ABI_VERSION and sizeof(MahiWDTPlugin) the plugin was built with */
+    uint32_t abiVersion;
+    uint32_t size;
+
+    const char* name;
+
+    /* Returns the plugin context or NULL, sets the hardware timeout. Kicks come at half of it */
+    void* (*open)(const char* args, unsigned int* maxIntervalSeconds);
+    void (*close)(void* context);
+
+    /* Blocking kick, required unless kickStart is set. Returns 0 on success */
+    int (*kick)(void* context);
+
+    /*
+     * Optional asynchronous kick for slow buses: start the kick and return a
+     * descriptor that becomes readable when it completes, or -1 on failure.
+     * kickFinish is called once it is readable and returns 0 on success.
+     * The descriptor stays owned by the plugin: MahiWDT only polls it and
+     * never closes it, so it may be the same one (e.g. an eventfd) for every
+     * kick. close may be called with a kick in flight and must cancel it.
+     */
+    int (*kickStart)(void* context);
+    int (*kickFinish)(void* context);
+
+    /* Optional: read back supervisor health, 0 when healthy */
+    int (*health)(void* context);
+
+    /* Optional: seconds until the hardware fires, negative when unknown */
+    int (*timeLeft)(void* context);
+
+    /*
+     * Optional: descriptor to keep open across an upgrade (SIGUSR2), or -1
+     * when open can simply run again in the new instance. Every other
+     * descriptor of the plugin must be close-on-exec. Upgrades are refused
+     * while a loaded plugin lacks this hook.
+     */
+    int (*handoff)(void* context);
+
+    /* Optional: called instead of open with the descriptor handoff returned */
+    void* (*resume)(const char* args, int fd, unsigned int* maxIntervalSeconds);
+} MahiWDTPlugin;
+
+#endif /* SRC_MAHIWDT_PLUGIN_H_ */
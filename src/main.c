@@ -29,6 +29,8 @@
 
 
 static volatile bool die = false;
+static volatile bool upgrade = false;
+static volatile bool dumpStatus = false;
 
 static void termHandler(int sig, siginfo_t *siginfo, void *context)
 {
@@ -36,6 +38,17 @@ static void termHandler(int sig, siginfo_t *siginfo, void *context)
 
 }
 
+static void upgradeHandler(int sig, siginfo_t *siginfo, void *context)
+{
+    upgrade = true;
+    die = true;
+}
+
+static void statusHandler(int sig, siginfo_t *siginfo, void *context)
+{
+    dumpStatus = true;
+}
+
 int main(int argc, char** argv)
 {
     /* Avoid broken pipe issues */
@@ -48,14 +61,43 @@ int main(int argc, char** argv)
     sigaction(SIGTERM, &action, NULL);
     sigaction(SIGINT, &action, NULL);
 
+    /* Catch SIGUSR2 to re-exec the (upgraded) binary */
+    action.sa_sigaction = &upgradeHandler;
+    sigaction(SIGUSR2, &action, NULL);
+
+    /* Catch SIGUSR1 to print the channel and group state */
+    action.sa_sigaction = &statusHandler;
+    sigaction(SIGUSR1, &action, NULL);
+
+    /* Blocked by the previous instance across the upgrade */
+    sigset_t upgradeMask;
+    sigemptyset(&upgradeMask);
+    sigaddset(&upgradeMask, SIGUSR2);
+    sigprocmask(SIG_UNBLOCK, &upgradeMask, NULL);
+
+    /* Parsing modifies the arguments, keep a copy to re-exec with */
+    char** execArgv = (char**)calloc(argc + 1, sizeof(char*));
+    if(!execArgv) return 1;
+    for(int i=0; i<argc; i++) {
+        execArgv[i] = strdup(argv[i]);
+    }
+
     WDTSystem s;
     memset(&s, 0, sizeof(s));
 
+    /* Pick up sockets, devices and deadlines of a previous instance */
+    s.resumed = handoffLoad();
+    handoffActivation();
+
     /* Set defaults */
     s.rebootDelaySeconds = 30;
 
+    /* Ports following -g are members of that group */
+    WDTGroup* currentGroup = NULL;
+    WDTDomain* currentDomain = NULL;
+
     int opt;
-    while ((opt = getopt(argc, argv, "n:w:p:r:c:u:")) != -1) {
+    while ((opt = getopt(argc, argv, "n:w:p:r:c:u:g:R:l:C:e:L:x:X:b:D:M:d:")) != -1) {
         switch (opt) {
             case 'n':
                 ;
@@ -78,9 +120,13 @@ int main(int argc, char** argv)
                 if(!strcmp(driver, "kernel")) {
                     char* path = strtok(NULL, ":");
                     char* interval = strtok(NULL, ":");
+                    char* pretimeout = strtok(NULL, ":");
+                    char* kickInterval = strtok(NULL, ":");
 
                     if(interval && path) {
-                        newDriver = kernelWDTDriverNew(path, atoi(interval));
+                        newDriver = kernelWDTDriverNew(path, atoi(interval),
+                                                       pretimeout ? atoi(pretimeout) : 0,
+                                                       kickInterval ? atoi(kickInterval) : 0);
                     } else {
                         errno = EINVAL;
                     }
@@ -89,9 +135,31 @@ int main(int argc, char** argv)
                     char* addr = strtok(NULL, ":");
                     char* wrdata = strtok(NULL, ":");
                     char* interval = strtok(NULL, ":");
+                    char* expect = strtok(NULL, ":");
 
                     if(bus && addr && wrdata && interval) {
-                        newDriver = i2cWDTDriverNew(bus, strtol(addr, NULL, 0), wrdata, atoi(interval));
+                        newDriver = i2cWDTDriverNew(bus, strtol(addr, NULL, 0), wrdata, expect, atoi(interval));
+                    } else {
+                        errno = EINVAL;
+                    }
+                } else if(!strcmp(driver, "udp")) {
+                    char* host = strtok(NULL, ":");
+                    char* service = strtok(NULL, ":");
+                    char* name = strtok(NULL, ":");
+                    char* keyFile = strtok(NULL, ":");
+                    char* interval = strtok(NULL, ":");
+
+                    if(host && service && name && keyFile && interval) {
+                        newDriver = udpWDTDriverNew(host, service, name, keyFile, atoi(interval));
+                    } else {
+                        errno = EINVAL;
+                    }
+                } else if(!strcmp(driver, "plugin")) {
+                    char* file = strtok(NULL, ":");
+                    char* args = strtok(NULL, "");
+
+                    if(file) {
+                        newDriver = pluginWDTDriverNew(file, args);
                     } else {
                         errno = EINVAL;
                     }
@@ -112,6 +180,10 @@ int main(int argc, char** argv)
                     goto cleanup;
                 }
 
+                if(currentDomain) {
+                    domainAddDriver(currentDomain, newDriver);
+                }
+
                 newDriver->next = s.wdtDriver;
                 s.wdtDriver = newDriver;
                 break;
@@ -120,14 +192,20 @@ int main(int argc, char** argv)
                 break;
             case 'p':
                 ;
-                char* path = strtok(optarg, ":");
-                char* startupInterval = strtok(NULL, ":");
-                char* normalInterval = strtok(NULL, ":");
-                char* portOwner = strtok(NULL, ":");
+                /* path:startup:normal[:owner[:rate[/burst]]], the owner may be empty */
+                char* path = strsep(&optarg, ":");
+                char* startupInterval = strsep(&optarg, ":");
+                char* normalInterval = strsep(&optarg, ":");
+                char* portOwner = strsep(&optarg, ":");
+                char* portRate = strsep(&optarg, ":");
+
+                if(portOwner && !*portOwner) {
+                    portOwner = NULL;
+                }
 
                 WDTPort* newPort = NULL;
 
-                if(path && startupInterval && normalInterval) {
+                if(path && *path && startupInterval && normalInterval) {
                     newPort = portInit(path, atoi(startupInterval), atoi(normalInterval), portOwner);
                 }
 
@@ -136,12 +214,242 @@ int main(int argc, char** argv)
                     goto cleanup;
                 }
 
+                /* Overrides the default of -L for this channel */
+                if(portRate) {
+                    char* portBurst = strchr(portRate, '/');
+                    if(portBurst) {
+                        *portBurst++ = 0;
+                    }
+
+                    uint32_t rateValue = atoi(portRate);
+                    portSetRateLimit(newPort, rateValue, portBurst ? (uint32_t)atoi(portBurst) : rateValue);
+                }
+
+                if(currentGroup) {
+                    groupAddPort(currentGroup, newPort);
+                }
+                if(currentDomain) {
+                    domainAddPort(currentDomain, newPort);
+                }
+
                 newPort->next = s.port;
                 s.port = newPort;
                 break;
+            case 'R':
+                ;
+                char* remoteName = strtok(optarg, ":");
+                char* remoteStartupInterval = strtok(NULL, ":");
+                char* remoteNormalInterval = strtok(NULL, ":");
+                char* keyFile = strtok(NULL, ":");
+
+                WDTPort* remotePort = NULL;
+
+                if(remoteName && remoteStartupInterval && remoteNormalInterval && keyFile) {
+                    remotePort = udpChannelNew(remoteName, atoi(remoteStartupInterval), atoi(remoteNormalInterval), keyFile);
+                } else {
+                    errno = EINVAL;
+                }
+
+                if(!remotePort) {
+                    fprintf(stderr, "Failed to init remote channel: %s\n", strerror(errno));
+                    goto cleanup;
+                }
+
+                if(currentGroup) {
+                    groupAddPort(currentGroup, remotePort);
+                }
+                if(currentDomain) {
+                    domainAddPort(currentDomain, remotePort);
+                }
+
+                remotePort->next = s.port;
+                s.port = remotePort;
+                break;
+            case 'C':
+                ;
+                char* cgroupPath = strtok(optarg, ":");
+                char* cgroupEvents = strtok(NULL, ":");
+
+                WDTPort* cgroupPort = NULL;
+
+                if(cgroupPath) {
+                    cgroupPort = cgroupChannelNew(cgroupPath, cgroupEvents);
+                } else {
+                    errno = EINVAL;
+                }
+
+                if(!cgroupPort) {
+                    fprintf(stderr, "Failed to watch cgroup: %s\n", strerror(errno));
+                    goto cleanup;
+                }
+
+                if(currentGroup) {
+                    groupAddPort(currentGroup, cgroupPort);
+                }
+                if(currentDomain) {
+                    domainAddPort(currentDomain, cgroupPort);
+                }
+
+                cgroupPort->next = s.port;
+                s.port = cgroupPort;
+                break;
+            case 'x':
+                ;
+                char* checkName = strtok(optarg, ":");
+                char* checkStartupInterval = strtok(NULL, ":");
+                char* checkNormalInterval = strtok(NULL, ":");
+                char* checkInterval = strtok(NULL, ":");
+                char* checkTimeout = strtok(NULL, ":");
+                char* checkCommand = strtok(NULL, "");
+
+                WDTPort* checkPort = NULL;
+
+                if(checkName && checkStartupInterval && checkNormalInterval && checkInterval && checkTimeout && checkCommand) {
+                    checkPort = checkChannelNew(checkName, atoi(checkStartupInterval), atoi(checkNormalInterval),
+                                                atoi(checkInterval), atoi(checkTimeout), checkCommand);
+                } else {
+                    errno = EINVAL;
+                }
+
+                if(!checkPort) {
+                    fprintf(stderr, "Failed to init health check: %s\n", strerror(errno));
+                    goto cleanup;
+                }
+
+                if(currentGroup) {
+                    groupAddPort(currentGroup, checkPort);
+                }
+                if(currentDomain) {
+                    domainAddPort(currentDomain, checkPort);
+                }
+
+                checkPort->next = s.port;
+                s.port = checkPort;
+                break;
+            case 'X':
+                s.maxChecks = atoi(optarg);
+                break;
+            case 'l':
+                ;
+                char* listenHost = strtok(optarg, ":");
+                char* listenService = strtok(NULL, ":");
+
+                WDTListener* newListener = NULL;
+
+                if(listenHost && listenService) {
+                    newListener = udpListenerNew(listenHost, listenService);
+                } else {
+                    errno = EINVAL;
+                }
+
+                if(!newListener) {
+                    fprintf(stderr, "Failed to listen: %s\n", strerror(errno));
+                    goto cleanup;
+                }
+
+                newListener->next = s.listener;
+                s.listener = newListener;
+                break;
+            case 'e':
+                if(!strcmp(optarg, "uring")) {
+                    s.useUring = true;
+                } else if(!strcmp(optarg, "poll")) {
+                    s.useUring = false;
+                } else {
+                    fprintf(stderr, "Unknown event loop backend %s\n", optarg);
+                    goto cleanup;
+                }
+                break;
+            case 'L':
+                ;
+                char* rate = strtok(optarg, ":");
+                char* burst = strtok(NULL, ":");
+
+                if(!rate) {
+                    fprintf(stderr, "Could not parse rate limit\n");
+                    goto cleanup;
+                }
+
+                s.kickRate = atoi(rate);
+                s.kickBurst = burst ? atoi(burst) : s.kickRate;
+                break;
+            case 'g':
+                ;
+                char* groupName = strtok(optarg, ":");
+                char* minAlive = strtok(NULL, ":");
+
+                if(groupName && !strcmp(groupName, "-")) {
+                    currentGroup = NULL;
+                    break;
+                }
+
+                char* minAliveEnd = NULL;
+                long minAliveValue = minAlive ? strtol(minAlive, &minAliveEnd, 10) : 0;
+
+                /* A group that needs no members alive could never fail */
+                if(!groupName || !minAlive || *minAliveEnd || minAliveValue <= 0 || minAliveValue > UINT32_MAX) {
+                    fprintf(stderr, "Could not parse group description\n");
+                    goto cleanup;
+                }
+
+                currentGroup = groupNew(groupName, minAliveValue);
+                if(!currentGroup) {
+                    fprintf(stderr, "Failed to create group: %s\n", strerror(errno));
+                    goto cleanup;
+                }
+
+                currentGroup->next = s.group;
+                s.group = currentGroup;
+                break;
+            case 'd':
+                ;
+                char* domainName = strtok(optarg, ":");
+                char* domainCommand = strtok(NULL, "");
+
+                if(domainName && !strcmp(domainName, "-")) {
+                    currentDomain = NULL;
+                    break;
+                }
+
+                if(!domainName) {
+                    fprintf(stderr, "Could not parse domain description\n");
+                    goto cleanup;
+                }
+
+                currentDomain = domainNew(domainName, domainCommand);
+                if(!currentDomain) {
+                    fprintf(stderr, "Failed to create domain: %s\n", strerror(errno));
+                    goto cleanup;
+                }
+
+                currentDomain->next = s.domain;
+                s.domain = currentDomain;
+                break;
             case 'c':
                 s.rebootCmd = strdup(optarg);
                 break;
+            case 'b':
+                ;
+                char* bootStateFile = strtok(optarg, ":");
+                char* bootStable = strtok(NULL, ":");
+                char* bootMax = strtok(NULL, ":");
+
+                /* 0 marks the boot as stable already, so it is not a valid uptime */
+                if(!bootStateFile || !bootStable || !bootMax || atoll(bootStable) <= 0 || !atoi(bootMax)) {
+                    fprintf(stderr, "Could not parse boot loop detection\n");
+                    goto cleanup;
+                }
+
+                s.bootStateFile = strdup(bootStateFile);
+                s.bootStableSeconds = atoll(bootStable);
+                s.bootLoopMax = atoi(bootMax);
+                break;
+            case 'D':
+                s.degradedPolicy = strdup(optarg);
+                break;
+            case 'M':
+                s.degradedRebootCmd = strdup(optarg);
+                break;
             case 'u':
                 s.dropPrivUser = strdup(optarg);
                 break;
@@ -150,25 +458,78 @@ int main(int argc, char** argv)
         }
     }
 
+    /* Close what the previous instance had but we were not configured for */
+    handoffRelease();
+
+    /* Default rate limit for channels without their own */
+    for(WDTPort* port = s.port; port; port=port->next) {
+        if(!port->rateIntervalNs) {
+            portSetRateLimit(port, s.kickRate, s.kickBurst);
+        }
+    }
+
+    for(WDTGroup* group = s.group; group; group=group->next) {
+        if(group->minAlive > group->members) {
+            fprintf(stderr, "Group %s requires %u of only %u channels\n", group->name, group->minAlive, group->members);
+            goto cleanup;
+        }
+    }
+
     if(!s.wdtDriver) {
         fprintf(stderr, "Please specify at least one watchdog device\n");
         goto cleanup;
     }
 
+    /* Needs the drivers for the boot status */
+    if(s.bootStateFile) {
+        s.degraded = bootLoopCheck(&s);
+        if(s.degraded) {
+            fprintf(stderr, "Boot loop: %u unstable watchdog boots, using degraded policy\n", s.bootCount);
+        }
+    }
+
+    if(s.degradedPolicy && !bootLoopDegrade(&s, s.degradedPolicy, s.degraded)) {
+        goto cleanup;
+    }
+
+    if(s.degraded && s.degradedRebootCmd) {
+        if(s.rebootCmd) free(s.rebootCmd);
+        s.rebootCmd = s.degradedRebootCmd;
+        s.degradedRebootCmd = NULL;
+    }
+
     if(s.dropPrivUser && changeUser(s.dropPrivUser)) {
         fprintf(stderr, "Failed to drop privileges\n");
         goto cleanup;
     }
 
     /* Run the wdt logic */
-    bool cleanExit = logicRun(&s, &die);
-    
+    bool cleanExit;
+    for(;;) {
+        cleanExit = logicRun(&s, &die, &dumpStatus);
+        if(!cleanExit || !upgrade) break;
+
+        /* Only returns on failure, in which case we keep running */
+        handoffExec(&s, execArgv);
+        fprintf(stderr, "Failed to upgrade (errno=%s)\n", strerror(errno));
+
+        upgrade = false;
+        die = false;
+        s.resumed = true;
+    }
+
     /* 1) A channel timed out, reset the HW wdt */
     for(WDTHWDriver* driver = s.wdtDriver; driver; driver=driver->next) {
-        wdtDriverKick(driver);
+        /* Let the hardware watchdog of a failed domain expire */
+        if(driver->domain && driver->domain->failed) continue;
+
+        wdtDriverKickSync(driver);
     }
 
     if(!cleanExit) {
+        /* Counts towards a boot loop, the boot status will not tell */
+        bootLoopTimeout(&s);
+
         /* 2) and try to do a clean reboot. */
         if(s.rebootCmd) {
             printf("Running: %s\n", s.rebootCmd);
@@ -182,7 +543,9 @@ int main(int argc, char** argv)
                 sleep(1);
                 s.rebootDelaySeconds--;
                 for(WDTHWDriver* driver = s.wdtDriver; driver; driver=driver->next) {
-                    wdtDriverKick(driver);
+                    if(driver->domain && driver->domain->failed) continue;
+
+                    wdtDriverKickSync(driver);
                 }
             }
         }
@@ -197,6 +560,20 @@ cleanup:
         port = nextPort;
     }
 
+    WDTListener* listener = s.listener;
+    while(listener) {
+        WDTListener* nextListener = listener->next;
+        udpListenerFree(listener);
+        listener = nextListener;
+    }
+
+    WDTGroup* group = s.group;
+    while(group) {
+        WDTGroup* nextGroup = group->next;
+        groupFree(group);
+        group = nextGroup;
+    }
+
     WDTHWDriver* driver = s.wdtDriver;
     while(driver) {
         WDTHWDriver* nextDriver = driver->next;
@@ -204,8 +581,23 @@ cleanup:
         driver=nextDriver;
     }
 
+    WDTDomain* domain = s.domain;
+    while(domain) {
+        WDTDomain* nextDomain = domain->next;
+        domainFree(domain);
+        domain = nextDomain;
+    }
+
     if(s.rebootCmd) free(s.rebootCmd);
     if(s.uptimeNotificationFile) free(s.uptimeNotificationFile);
     if(s.dropPrivUser) free(s.dropPrivUser);
+    if(s.bootStateFile) free(s.bootStateFile);
+    if(s.degradedPolicy) free(s.degradedPolicy);
+    if(s.degradedRebootCmd) free(s.degradedRebootCmd);
+
+    for(int i=0; i<argc; i++) {
+        free(execArgv[i]);
+    }
+    free(execArgv);
 }
 
@@ -32,11 +32,96 @@ void portKick(WDTPort* port, bool initial)
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
 
-    if(initial) {
-        port->expirySeconds = now.tv_sec + port->startupTimeoutSeconds;
+    uint32_t timeoutSeconds = initial ? port->startupTimeoutSeconds : port->normalTimeoutSeconds;
+
+    /* Event only channels have no deadline */
+    if(port->noDeadline) {
+        port->expirySeconds = -1ULL;
     } else {
-        port->expirySeconds = now.tv_sec + port->normalTimeoutSeconds;
+        port->expirySeconds = now.tv_sec + timeoutSeconds;
     }
+
+    if(!port->alive) {
+        port->alive = true;
+        if(port->group) {
+            groupPortUp(port->group);
+        }
+    }
+}
+
+int portParseMessage(const uint8_t* buf, ssize_t len)
+{
+    if(len == 4 && memcmp(buf, "KICK", 4) == 0) {
+        return WDT_MSG_KICK;
+    } else if(len == 5 && memcmp(buf, "ERROR", 5) == 0) {
+        return WDT_MSG_ERROR;
+    }
+
+    return WDT_MSG_NONE;
+}
+
+void portSetRateLimit(WDTPort* port, uint32_t rate, uint32_t burst)
+{
+    if(!rate) return;
+    if(!burst) burst = 1;
+
+    port->rateIntervalNs = 1000000000ULL / rate;
+    port->rateToleranceNs = (burst - 1) * port->rateIntervalNs;
+
+    /*
+     * The receive queue of a datagram socket is bounded by
+     * net.unix.max_dgram_qlen rather than by its buffer size, so a flood
+     * costs at most that many datagrams before senders block or get EAGAIN.
+     */
+}
+
+bool portAdmit(WDTPort* port)
+{
+    if(!port->rateIntervalNs) return true;
+
+    uint64_t nowNs = utilGetMonotonicNs();
+
+    if(port->rateTheoreticalArrivalNs > nowNs + port->rateToleranceNs) {
+        port->rateLimited = true;
+        port->dropped++;
+        return false;
+    }
+
+    if(port->rateTheoreticalArrivalNs < nowNs) {
+        port->rateTheoreticalArrivalNs = nowNs;
+    }
+    port->rateTheoreticalArrivalNs += port->rateIntervalNs;
+    port->rateLimited = false;
+
+    return true;
+}
+
+bool portExpire(WDTPort* port)
+{
+    /* Disarm until the next kick */
+    port->expirySeconds = -1ULL;
+
+    if(!port->alive) {
+        return true;
+    }
+
+    port->alive = false;
+
+    bool quorum = port->group ? groupPortDown(port->group) : false;
+
+    /* Excluded from rebooting by the degraded boot loop policy */
+    if(port->noReboot) {
+        fprintf(stderr, "Channel %s failed, not rebooting in degraded mode\n", port->name);
+        return true;
+    }
+
+    /* Outside the default domain only the domain itself fails */
+    if(!quorum && port->domain) {
+        return domainFail(port->domain);
+    }
+
+    /* Ungrouped ports are fatal on their own */
+    return quorum;
 }
 
 void portUninit(WDTPort* port)
@@ -51,27 +136,86 @@ void portUninit(WDTPort* port)
         unlink(port->laddr.sun_path);
     }
 
+    if(port->remote) {
+        udpChannelFree(port);
+    }
+
+    if(port->cgroup) {
+        cgroupChannelFree(port);
+    }
+
+    if(port->check) {
+        checkChannelFree(port);
+    }
+
+    if(port->name) {
+        free(port->name);
+    }
+
     free(port);
 }
 
-WDTPort* portInit(const char* path, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds, char* portOwner)
+WDTPort* portAlloc(const char* name, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds)
 {
     WDTPort* port = (WDTPort*)calloc(1, sizeof(WDTPort));
-    if(!port) return false;
-    memset(port, 0, sizeof(*port));
+    if(!port) return NULL;
+
+    port->fd = -1;
+
+    port->name = strdup(name);
+    if(!port->name) {
+        free(port);
+        return NULL;
+    }
+
+    /* Set timing */
+    port->startupTimeoutSeconds = startupTimeoutSeconds;
+    port->normalTimeoutSeconds = normalTimeoutSeconds;
+
+    return port;
+}
+
+WDTPort* portInit(const char* path, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds, char* portOwner)
+{
+    WDTPort* port = portAlloc(path, startupTimeoutSeconds, normalTimeoutSeconds);
+    if(!port) return NULL;
 
     /* Set path */
     port->laddr.sun_family = AF_UNIX;
     strncpy(port->laddr.sun_path, path, sizeof(port->laddr.sun_path) - 1);
 
+    /* Take over the bound socket and deadline of a previous instance */
+    uint64_t expirySeconds;
+    port->fd = handoffTake('p', path, &expirySeconds);
+    if(port->fd >= 0) {
+        port->bound = true;
+        port->alive = true;
+        port->expirySeconds = expirySeconds;
+        return port;
+    }
+
+    /* Socket activation, by path or by the basename given as descriptor name */
+    port->fd = handoffTake('a', path, &expirySeconds);
+    if(port->fd < 0 && strrchr(path, '/')) {
+        port->fd = handoffTake('a', strrchr(path, '/') + 1, &expirySeconds);
+    }
+    if(port->fd >= 0) {
+        /* Bound and owned by the activator, never unlinked by us */
+        port->activated = true;
+
+        if(expirySeconds) {
+            port->alive = true;
+            port->expirySeconds = expirySeconds;
+        } else {
+            portKick(port, true);
+        }
+        return port;
+    }
+
     /* Delete path */
     unlink(path);
 
-    /* Set timing */
-    port->startupTimeoutSeconds = startupTimeoutSeconds;
-    port->normalTimeoutSeconds = normalTimeoutSeconds;
-
-    port->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    port->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
     if (port->fd < 0) goto error;
 
     fchmod(port->fd, 0700);
@@ -68,10 +68,6 @@ int getUidGid(char* username, uid_t* uid, gid_t* gid)
 
 int changeUser(char* username)
 {
-    if (getuid() != 0) {
-        return -1;
-    }
-
     uid_t uid;
     gid_t gid;
 
@@ -79,6 +75,15 @@ int changeUser(char* username)
         return -1;
     }
 
+    /* Already dropped, e.g. after an upgrade re-exec */
+    if (getuid() == uid && geteuid() == uid) {
+        return 0;
+    }
+
+    if (getuid() != 0) {
+        return -1;
+    }
+
     if(setgid(gid) != 0) return -1;
     if(initgroups(username, gid)) return -1;
     if(setuid(uid) != 0) return -1;
@@ -45,11 +45,128 @@
 #ifndef SRC_PROJECT_H_
 #define SRC_PROJECT_H_
 
+typedef struct WDTDomain {
+    char* name;
+
+    /* Run when the domain fails, may be NULL */
+    char* command;
+    pid_t commandPid;
+
+    /* Drivers of a failed domain are no longer kicked */
+    uint32_t drivers;
+    uint32_t channels;
+    bool failed;
+
+    uint64_t failures;
+    uint64_t lastFailureSeconds;
+
+    struct WDTDomain* next;
+} WDTDomain;
+
+typedef struct WDTGroup {
+    char* name;
+
+    /* Fail when fewer than this many members are alive */
+    uint32_t minAlive;
+
+    uint32_t members;
+    uint32_t alive;
+
+    struct WDTGroup* next;
+} WDTGroup;
+
+#define WDT_HMAC_SIZE 32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t length;
+    uint8_t buf[64];
+    size_t bufLen;
+} WDTSha256;
+
+typedef struct {
+    WDTSha256 inner;
+    WDTSha256 outer;
+} WDTHmac;
+
+/* Message types received on a channel */
+#define WDT_MSG_NONE 0
+#define WDT_MSG_KICK 1
+#define WDT_MSG_ERROR 2
+
+/* Largest authenticated heartbeat datagram: header, 255 byte name, counter and MAC */
+#define WDT_UDP_MESSAGE_MAX 302
+
+/* Channel kicked over UDP with authenticated heartbeats */
+typedef struct WDTRemote {
+    WDTHmac key;
+
+    /* Replay protection */
+    uint64_t lastCounter;
+
+    struct WDTPort* port;
+    struct WDTRemote* hashNext;
+} WDTRemote;
+
+typedef struct WDTListener {
+    char* address;
+    int fd;
+
+    /* Datagrams failing authentication or replay checks */
+    uint64_t rejected;
+
+    struct WDTListener* next;
+} WDTListener;
+
+/* Cgroup conditions that fail a channel */
+#define WDT_CGROUP_OOM (1 << 0)
+#define WDT_CGROUP_EMPTY (1 << 1)
+#define WDT_CGROUP_FROZEN (1 << 2)
+
+/* cpu, memory and io pressure stall triggers */
+#define WDT_CGROUP_PRESSURE_MAX 3
+
+typedef struct WDTCgroup {
+    const char* path;
+    uint32_t events;
+
+    /* Polled on their own with POLLPRI, PSI triggers do not work nested in epoll */
+    int pressureFd[WDT_CGROUP_PRESSURE_MAX];
+    uint32_t pressureStallUs[WDT_CGROUP_PRESSURE_MAX];
+    uint32_t pressureWindowUs[WDT_CGROUP_PRESSURE_MAX];
+
+    int64_t oomKills;
+
+    uint64_t checks;
+    uint64_t failures;
+} WDTCgroup;
+
+typedef struct WDTCheck {
+    char* command;
+    uint32_t intervalSeconds;
+    uint32_t timeoutSeconds;
+
+    uint64_t nextRunSeconds;
+    uint64_t deadlineSeconds;
+
+    /* Running when the pidfd is valid */
+    pid_t pid;
+    int pidFd;
+    bool killed;
+
+    uint64_t runs;
+    uint64_t failures;
+    uint64_t timeouts;
+} WDTCheck;
+
 typedef struct WDTPort {
+    char* name;
+
     /* Socket */
     struct sockaddr_un laddr;
     int fd;
     bool bound;
+    bool activated;
 
     /* Timing settings */
     uint32_t startupTimeoutSeconds;
@@ -58,21 +175,100 @@ typedef struct WDTPort {
     /* When will this timer expire */
     uint64_t expirySeconds;
 
+    /* Quorum group, the port is dead between expiry and the next kick */
+    WDTGroup* group;
+    bool alive;
+
+    /* Remote (UDP) channels have no socket of their own */
+    WDTRemote* remote;
+
+    /* Cgroup channels poll an inotify descriptor instead of a socket */
+    WDTCgroup* cgroup;
+
+    /* Event only channel, kicks never arm a deadline */
+    bool noDeadline;
+
+    /* Health check channels are kicked by a command exiting successfully */
+    WDTCheck* check;
+
+    /* Set by the degraded boot loop policy */
+    bool noReboot;
+
+    /* NULL for the default domain */
+    WDTDomain* domain;
+
+    /* Rate limit (GCRA form of a token bucket), no limit when the interval is 0 */
+    uint64_t rateIntervalNs;
+    uint64_t rateToleranceNs;
+    uint64_t rateTheoreticalArrivalNs;
+    bool rateLimited;
+    uint64_t dropped;
+
     struct WDTPort* next;
 } WDTPort;
 
+#define WDT_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+    uint64_t count[WDT_HISTOGRAM_BUCKETS];
+    uint64_t samples;
+    uint64_t min;
+    uint64_t max;
+} WDTHistogram;
+
+/* Event loop self-latency, all in microseconds */
+typedef struct {
+    WDTHistogram wakeLag;
+    WDTHistogram driverKick;
+    WDTHistogram dispatch;
+    WDTHistogram iteration;
+
+    uint64_t kickMarginSeconds;
+    uint64_t lagWarnings;
+    uint64_t lagWarnedNs;
+} WDTLoopStats;
+
 typedef struct WDTHWDriver {
     uint64_t wdtMaxIntervalSeconds;
     void* wdtContext;
 
+    /* Whether the device could tell if it caused the last reset */
+    bool wdtBootStatusKnown;
+    bool wdtBootByWatchdog;
+
     void(*wdtKickFunc)(void* context);
     void(*wdtFreeFunc)(void* context);
 
+    /* Optional: descriptor that must survive an upgrade, identified by key */
+    int(*wdtHandoffFunc)(void* context, const char** key);
+
+    /* Cannot be carried over to a new instance, upgrades are refused */
+    bool wdtNoUpgrade;
+
+    /* Optional: print driver statistics */
+    void(*wdtStatusFunc)(void* context, FILE* f);
+
+    /* Optional asynchronous kick, start returns a descriptor that becomes readable on completion */
+    int(*wdtKickStartFunc)(void* context);
+    void(*wdtKickFinishFunc)(void* context);
+
+    /* In flight asynchronous kick */
+    bool wdtKickPending;
+    int wdtKickFd;
+    uint64_t wdtKickOverruns;
+    uint64_t wdtKickTimeouts;
+
+    /* NULL for the default domain */
+    WDTDomain* domain;
+
     struct WDTHWDriver* next;
 } WDTHWDriver;
 
 typedef struct {
     WDTPort* port;
+    WDTGroup* group;
+    WDTDomain* domain;
+    WDTListener* listener;
     uint32_t rebootDelaySeconds;
 
     WDTHWDriver* wdtDriver;
@@ -83,22 +279,128 @@ typedef struct {
     char* rebootCmd;
 
     char* dropPrivUser;
+
+    /* State was handed over by a previous instance */
+    bool resumed;
+
+    /* Event loop backend, falls back to poll when io_uring is unavailable */
+    bool useUring;
+
+    /* Default kick rate limit of channels that do not set their own */
+    uint32_t kickRate;
+    uint32_t kickBurst;
+
+    /* Health checks running at the same time, 0 for no limit */
+    uint32_t maxChecks;
+
+    WDTLoopStats loop;
+
+    /* Boot loop detection, disabled without a state file */
+    char* bootStateFile;
+    uint64_t bootStableSeconds;
+    uint32_t bootLoopMax;
+    uint32_t bootCount;
+    bool bootPending;
+    bool degraded;
+    char* degradedPolicy;
+    char* degradedRebootCmd;
 } WDTSystem;
 
+typedef struct WDTUring WDTUring;
+
 void wdtDriverKick(WDTHWDriver* driver);
 void wdtDriverFree(WDTHWDriver* driver);
+int wdtDriverHandoff(WDTHWDriver* driver, const char** key);
+void wdtDriverStatus(WDTHWDriver* driver, FILE* f);
+void wdtDriverKickFinish(WDTHWDriver* driver);
+void wdtDriverKickSync(WDTHWDriver* driver);
 
 void portKick(WDTPort* port, bool initial);
+bool portExpire(WDTPort* port);
+int portParseMessage(const uint8_t* buf, ssize_t len);
+void portSetRateLimit(WDTPort* port, uint32_t rate, uint32_t burst);
+bool portAdmit(WDTPort* port);
 void portUninit(WDTPort* port);
+WDTPort* portAlloc(const char* name, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds);
 WDTPort* portInit(const char* path, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds, char* portOwner);
 
-bool logicRun(WDTSystem* s, volatile bool* die);
+WDTGroup* groupNew(const char* name, uint32_t minAlive);
+void groupFree(WDTGroup* group);
+void groupAddPort(WDTGroup* group, WDTPort* port);
+void groupPortUp(WDTGroup* group);
+bool groupPortDown(WDTGroup* group);
+
+WDTDomain* domainNew(const char* name, const char* command);
+void domainFree(WDTDomain* domain);
+void domainAddPort(WDTDomain* domain, WDTPort* port);
+void domainAddDriver(WDTDomain* domain, WDTHWDriver* driver);
+bool domainFail(WDTDomain* domain);
+void domainRun(WDTSystem* s);
 
-WDTHWDriver* kernelWDTDriverNew(const char* path, int interval);
+bool logicRun(WDTSystem* s, volatile bool* die, volatile bool* dumpStatus);
+bool logicPortMessage(WDTPort* port, int msg);
+bool logicPortReady(WDTPort* port);
+bool logicListenerReady(WDTListener* l);
+bool logicCheckReady(WDTPort* port);
+bool logicPressureReady(WDTPort* port, int fd);
+
+bool bootLoopCheck(WDTSystem* s);
+void bootLoopStable(WDTSystem* s);
+void bootLoopTimeout(WDTSystem* s);
+bool bootLoopDegrade(WDTSystem* s, char* policy, bool apply);
+
+WDTUring* uringNew(WDTSystem* s);
+bool uringWait(WDTUring* u, uint64_t timeoutNs, uint64_t* wokeNs);
+void uringFree(WDTUring* u);
+
+void statusDump(WDTSystem* s, FILE* f);
+
+WDTHWDriver* kernelWDTDriverNew(const char* path, int interval, int pretimeout, int kickInterval);
 WDTHWDriver* dummyWDTDriverNew(unsigned int interval);
-WDTHWDriver* i2cWDTDriverNew(const char* bus, uint8_t addr, char* wrData, unsigned int interval);
+WDTHWDriver* i2cWDTDriverNew(const char* bus, uint8_t addr, char* wrData, char* expectData, unsigned int interval);
+WDTHWDriver* pluginWDTDriverNew(const char* file, const char* args);
+WDTHWDriver* udpWDTDriverNew(const char* host, const char* service, const char* name, const char* keyFile, unsigned int interval);
+
+void sha256Init(WDTSha256* c);
+void sha256Update(WDTSha256* c, const uint8_t* data, size_t len);
+void sha256Final(WDTSha256* c, uint8_t* digest);
+void hmacInit(WDTHmac* h, const uint8_t* key, size_t keyLen);
+void hmacCompute(const WDTHmac* h, const uint8_t* data, size_t len, uint8_t* mac);
+bool hmacVerify(const WDTHmac* h, const uint8_t* data, size_t len, const uint8_t* mac);
+
+bool udpKeyLoad(const char* keyFile, WDTHmac* key);
+size_t udpMessageBuild(uint8_t* buf, size_t size, const char* name, uint8_t type, uint64_t counter, const WDTHmac* key);
+int udpReceive(WDTListener* l, WDTPort** port);
+int udpParse(WDTListener* l, const uint8_t* buf, ssize_t len, WDTPort** port);
+WDTPort* udpChannelNew(const char* name, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds, const char* keyFile);
+void udpChannelFree(WDTPort* port);
+bool cgroupCheck(WDTPort* port);
+bool cgroupPressureReady(WDTPort* port, int fd);
+WDTPort* cgroupChannelNew(const char* path, char* events);
+void cgroupChannelFree(WDTPort* port);
+WDTPort* checkChannelNew(const char* name, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds,
+                         uint32_t intervalSeconds, uint32_t timeoutSeconds, const char* command);
+void checkChannelFree(WDTPort* port);
+uint64_t checkRun(WDTSystem* s, uint64_t nowSeconds);
+bool checkReap(WDTPort* port);
+void checkStop(WDTPort* port);
+
+WDTListener* udpListenerNew(const char* host, const char* service);
+void udpListenerFree(WDTListener* l);
 
 uint64_t utilGetUptimeSeconds();
+uint64_t utilGetMonotonicNs();
+pid_t utilSpawnShell(const char* command);
+
+void histogramAdd(WDTHistogram* h, uint64_t value);
+void histogramPrint(const WDTHistogram* h, FILE* f, const char* name, const char* unit);
+
+bool handoffLoad();
+void handoffActivation();
+int handoffTake(char type, const char* key, uint64_t* value);
+bool handoffTakeValue(char type, const char* key, uint64_t* value);
+void handoffRelease();
+bool handoffExec(WDTSystem* s, char** argv);
 
 int changeUser(char* username);
 int getUidGid(char* username, uid_t* uid, gid_t* gid);
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "project.h"
+
+void statusDump(WDTSystem* s, FILE* f)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(WDTPort* port = s->port; port; port=port->next) {
+        fprintf(f, "Channel %s: ", port->name);
+
+        if(port->alive && port->expirySeconds == -1ULL) {
+            fprintf(f, "alive");
+        } else if(port->alive) {
+            fprintf(f, "alive, expires in %llds", (long long)(port->expirySeconds - now.tv_sec));
+        } else {
+            fprintf(f, "dead");
+        }
+
+        if(port->group) {
+            fprintf(f, ", group %s", port->group->name);
+        }
+
+        if(port->domain) {
+            fprintf(f, ", domain %s", port->domain->name);
+        }
+
+        if(port->dropped) {
+            fprintf(f, ", %llu dropped", (unsigned long long)port->dropped);
+        }
+
+        if(port->cgroup) {
+            fprintf(f, ", %llu cgroup events, %llu failed", (unsigned long long)port->cgroup->checks,
+                    (unsigned long long)port->cgroup->failures);
+        }
+
+        if(port->check) {
+            fprintf(f, ", %s, %llu runs, %llu failed, %llu timed out",
+                    port->check->pidFd >= 0 ? "running" : (port->check->nextRunSeconds <= now.tv_sec ? "queued" : "idle"),
+                    (unsigned long long)port->check->runs, (unsigned long long)port->check->failures,
+                    (unsigned long long)port->check->timeouts);
+        }
+
+        fprintf(f, "\n");
+    }
+
+    for(WDTListener* l = s->listener; l; l=l->next) {
+        fprintf(f, "Listener %s: %llu rejected\n", l->address, (unsigned long long)l->rejected);
+    }
+
+    for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+        wdtDriverStatus(driver, f);
+    }
+
+    if(s->bootStateFile) {
+        fprintf(f, "Boot loop: %u unstable boots, %s%s\n", s->bootCount, s->degraded ? "degraded" : "normal",
+                s->bootPending ? ", not stable yet" : "");
+    }
+
+    fprintf(f, "Event loop: lag high-water mark %lluus, kick margin %llus, %llu lag warnings\n",
+            (unsigned long long)s->loop.wakeLag.max, (unsigned long long)s->loop.kickMarginSeconds,
+            (unsigned long long)s->loop.lagWarnings);
+    histogramPrint(&s->loop.wakeLag, f, "  Wakeup lag", "us");
+    histogramPrint(&s->loop.driverKick, f, "  Driver kicks", "us");
+    histogramPrint(&s->loop.dispatch, f, "  Event dispatch", "us");
+    histogramPrint(&s->loop.iteration, f, "  Iteration busy time", "us");
+
+    for(WDTDomain* domain = s->domain; domain; domain=domain->next) {
+        fprintf(f, "Domain %s: %s, %u channels, %u drivers, %llu failures",
+                domain->name, domain->failed ? "failed" : "ok", domain->channels, domain->drivers,
+                (unsigned long long)domain->failures);
+        if(domain->failures) {
+            fprintf(f, ", last %llds ago", (long long)(now.tv_sec - domain->lastFailureSeconds));
+        }
+        fprintf(f, "\n");
+    }
+
+    for(WDTGroup* group = s->group; group; group=group->next) {
+        fprintf(f, "Group %s: %u of %u alive, %u required\n",
+                group->name, group->alive, group->members, group->minAlive);
+    }
+
+    fflush(f);
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "project.h"
+#include <netdb.h>
+
+/*
+ * Heartbeat datagram:
+ *   "MWDT" | version | type ('K'/'E') | name length | name | counter (u64, big endian) | HMAC-SHA256
+ * The MAC covers everything before it. Counters must strictly increase per channel.
+ * The sender uses realtime microseconds as counter, so counters far from our own clock
+ * are rejected too: the last counter does not survive a restart of the receiver.
+ */
+#define UDP_MAGIC "MWDT"
+#define UDP_VERSION 1
+#define UDP_HEADER_SIZE 7
+#define UDP_TABLE_SIZE 1024
+
+/* Accepted clock difference between sender and receiver */
+#define UDP_FRESHNESS_US (60 * 1000000ULL)
+
+static WDTRemote* remoteTable[UDP_TABLE_SIZE];
+
+static uint32_t udpHashName(const char* name, size_t len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for(size_t i=0; i<len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash % UDP_TABLE_SIZE;
+}
+
+static WDTRemote* udpLookup(const char* name, size_t len)
+{
+    for(WDTRemote* r = remoteTable[udpHashName(name, len)]; r; r=r->hashNext) {
+        if(strlen(r->port->name) == len && !memcmp(r->port->name, name, len)) {
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+bool udpKeyLoad(const char* keyFile, WDTHmac* key)
+{
+    uint8_t buf[4096];
+
+    int fd = open(keyFile, O_RDONLY);
+    if(fd < 0) return false;
+
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    if(len <= 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    hmacInit(key, buf, len);
+    memset(buf, 0, sizeof(buf));
+
+    return true;
+}
+
+size_t udpMessageBuild(uint8_t* buf, size_t size, const char* name, uint8_t type, uint64_t counter, const WDTHmac* key)
+{
+    size_t nameLen = strlen(name);
+    size_t len = UDP_HEADER_SIZE + nameLen + 8;
+
+    if(nameLen > 255 || len + WDT_HMAC_SIZE > size) return 0;
+
+    memcpy(buf, UDP_MAGIC, 4);
+    buf[4] = UDP_VERSION;
+    buf[5] = type == WDT_MSG_ERROR ? 'E' : 'K';
+    buf[6] = nameLen;
+    memcpy(buf + UDP_HEADER_SIZE, name, nameLen);
+
+    for(int i=0; i<8; i++) {
+        buf[UDP_HEADER_SIZE + nameLen + i] = counter >> (56 - 8*i);
+    }
+
+    hmacCompute(key, buf, len, buf + len);
+
+    return len + WDT_HMAC_SIZE;
+}
+
+int udpReceive(WDTListener* l, WDTPort** port)
+{
+    uint8_t buf[WDT_UDP_MESSAGE_MAX];
+
+    ssize_t len = recv(l->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if(len < 0) {
+        return -1;
+    }
+
+    return udpParse(l, buf, len, port);
+}
+
+int udpParse(WDTListener* l, const uint8_t* buf, ssize_t len, WDTPort** port)
+{
+    if(len < UDP_HEADER_SIZE + 8 + WDT_HMAC_SIZE || memcmp(buf, UDP_MAGIC, 4) || buf[4] != UDP_VERSION) {
+        return WDT_MSG_NONE;
+    }
+
+    size_t nameLen = buf[6];
+    size_t macOffset = UDP_HEADER_SIZE + nameLen + 8;
+    if(len != macOffset + WDT_HMAC_SIZE) {
+        return WDT_MSG_NONE;
+    }
+
+    WDTRemote* r = udpLookup((const char*)buf + UDP_HEADER_SIZE, nameLen);
+    if(!r || !hmacVerify(&r->key, buf, macOffset, buf + macOffset)) {
+        l->rejected++;
+        return WDT_MSG_NONE;
+    }
+
+    uint64_t counter = 0;
+    for(int i=0; i<8; i++) {
+        counter = (counter << 8) | buf[UDP_HEADER_SIZE + nameLen + i];
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t nowUs = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    /* Replayed, reordered or captured outside the freshness window */
+    if(counter <= r->lastCounter || counter + UDP_FRESHNESS_US < nowUs || counter > nowUs + UDP_FRESHNESS_US) {
+        l->rejected++;
+        return WDT_MSG_NONE;
+    }
+    r->lastCounter = counter;
+
+    *port = r->port;
+
+    if(buf[5] == 'E') {
+        return WDT_MSG_ERROR;
+    }
+
+    return WDT_MSG_KICK;
+}
+
+WDTPort* udpChannelNew(const char* name, uint32_t startupTimeoutSeconds, uint32_t normalTimeoutSeconds, const char* keyFile)
+{
+    if(strlen(name) > 255 || udpLookup(name, strlen(name))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    WDTPort* port = portAlloc(name, startupTimeoutSeconds, normalTimeoutSeconds);
+    if(!port) return NULL;
+
+    WDTRemote* r = (WDTRemote*)calloc(1, sizeof(WDTRemote));
+    if(!r) goto error;
+
+    r->port = port;
+    port->remote = r;
+
+    if(!udpKeyLoad(keyFile, &r->key)) goto error;
+
+    uint32_t hash = udpHashName(name, strlen(name));
+    r->hashNext = remoteTable[hash];
+    remoteTable[hash] = r;
+
+    /* Continue the deadline and replay window of a previous instance */
+    uint64_t value;
+    if(handoffTakeValue('c', name, &value)) {
+        r->lastCounter = value;
+    }
+    if(handoffTakeValue('r', name, &value)) {
+        port->expirySeconds = value;
+        port->alive = true;
+        return port;
+    }
+
+    portKick(port, true);
+
+    return port;
+
+error:
+    portUninit(port);
+    return NULL;
+}
+
+void udpChannelFree(WDTPort* port)
+{
+    WDTRemote* r = port->remote;
+
+    for(WDTRemote** e = &remoteTable[udpHashName(port->name, strlen(port->name))]; *e; e = &(*e)->hashNext) {
+        if(*e == r) {
+            *e = r->hashNext;
+            break;
+        }
+    }
+
+    memset(r, 0, sizeof(*r));
+    free(r);
+    port->remote = NULL;
+}
+
+void udpListenerFree(WDTListener* l)
+{
+    if(!l) return;
+
+    if(l->fd >= 0) {
+        close(l->fd);
+    }
+
+    free(l->address);
+    free(l);
+}
+
+WDTListener* udpListenerNew(const char* host, const char* service)
+{
+    WDTListener* l = (WDTListener*)calloc(1, sizeof(WDTListener));
+    if(!l) return NULL;
+
+    l->fd = -1;
+
+    l->address = (char*)malloc(strlen(host) + strlen(service) + 2);
+    if(!l->address) goto error;
+    sprintf(l->address, "%s:%s", host, service);
+
+    /* Keep receiving on the socket of a previous instance */
+    l->fd = handoffTake('l', l->address, NULL);
+    if(l->fd >= 0) {
+        fcntl(l->fd, F_SETFL, O_NONBLOCK);
+        return l;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if(getaddrinfo(host, service, &hints, &res)) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    l->fd = socket(res->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(l->fd < 0 || bind(l->fd, res->ai_addr, res->ai_addrlen)) {
+        int err = errno;
+        freeaddrinfo(res);
+        errno = err;
+        goto error;
+    }
+
+    freeaddrinfo(res);
+
+    return l;
+
+error:
+    udpListenerFree(l);
+    return NULL;
+}
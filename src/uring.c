@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2019, Bertold Van den Bergh (vandenbergh@bertold.org, https://projectmahi.com/)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "project.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * io_uring event loop backend. Every channel and listener socket has a
+ * multishot receive posted that picks buffers from a provided buffer ring,
+ * other descriptors use (multishot) poll requests. Each wakeup submits,
+ * waits with the deadline as timeout and reaps in a single io_uring_enter.
+ */
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 512
+#define URING_BGID 0
+
+/* user_data carries the source type in the upper 32 bits and its index below */
+#define URING_PORT_RECV 1
+#define URING_PORT_POLL 2
+#define URING_LISTENER_RECV 3
+#define URING_DRIVER_POLL 4
+#define URING_CHECK_POLL 5
+#define URING_PRESSURE_POLL 6
+
+struct WDTUring {
+    int fd;
+
+    void* sqRing;
+    size_t sqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail;
+
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+
+    struct io_uring_buf_ring* bufRing;
+    size_t bufRingSize;
+    uint8_t* buffers;
+    uint16_t bufTail;
+
+    /* Cleared when the kernel predates multishot receive */
+    bool multishot;
+
+    WDTPort** ports;
+    unsigned int numPorts;
+    WDTListener** listeners;
+    unsigned int numListeners;
+    WDTHWDriver** drivers;
+    bool* driverArmed;
+    unsigned int numDrivers;
+    WDTPort** checks;
+    bool* checkArmed;
+    unsigned int numChecks;
+    WDTPort** pressurePorts;
+    int* pressureFds;
+    unsigned int numPressure;
+};
+
+static int uringEnter(WDTUring* u, unsigned int toSubmit, unsigned int minComplete, unsigned int flags, void* arg, size_t argSize)
+{
+    return syscall(__NR_io_uring_enter, u->fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static unsigned int uringPending(WDTUring* u)
+{
+    return u->sqLocalTail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE);
+}
+
+static struct io_uring_sqe* uringGetSqe(WDTUring* u)
+{
+    /* Ring full, hand what we have to the kernel first */
+    if(uringPending(u) >= u->sqEntries) {
+        __atomic_store_n(u->sqTail, u->sqLocalTail, __ATOMIC_RELEASE);
+        if(uringEnter(u, uringPending(u), 0, 0, NULL, 0) < 0) {
+            return NULL;
+        }
+    }
+
+    unsigned int index = u->sqLocalTail & *u->sqMask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqArray[index] = index;
+    u->sqLocalTail++;
+
+    return sqe;
+}
+
+static bool uringArmRecv(WDTUring* u, int fd, unsigned int type, unsigned int index)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(u);
+    if(!sqe) return false;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = u->multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uint64_t)type << 32 | index;
+
+    return true;
+}
+
+static bool uringArmPoll(WDTUring* u, int fd, bool multishot, unsigned int type, unsigned int index)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(u);
+    if(!sqe) return false;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN | POLLPRI;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = (uint64_t)type << 32 | index;
+
+    return true;
+}
+
+static bool uringArmPort(WDTUring* u, unsigned int index)
+{
+    WDTPort* port = u->ports[index];
+
+    if(port->fd < 0) return true;
+
+    if(port->cgroup) {
+        return uringArmPoll(u, port->fd, true, URING_PORT_POLL, index);
+    }
+
+    return uringArmRecv(u, port->fd, URING_PORT_RECV, index);
+}
+
+static void uringRecycleBuffer(WDTUring* u, unsigned int bid)
+{
+    struct io_uring_buf* buf = &u->bufRing->bufs[u->bufTail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(u->buffers + bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    u->bufTail++;
+}
+
+/* Returns false when the system has to go down */
+static bool uringComplete(WDTUring* u, struct io_uring_cqe* cqe)
+{
+    unsigned int type = cqe->user_data >> 32;
+    unsigned int index = cqe->user_data & 0xffffffff;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    bool ok = true;
+
+    if(type == URING_DRIVER_POLL) {
+        u->driverArmed[index] = false;
+        wdtDriverKickFinish(u->drivers[index]);
+        return true;
+    }
+
+    if(type == URING_CHECK_POLL) {
+        u->checkArmed[index] = false;
+        return logicCheckReady(u->checks[index]);
+    }
+
+    if(type == URING_PRESSURE_POLL) {
+        if(cqe->res < 0 && cqe->res != -EINTR) {
+            errno = -cqe->res;
+            return false;
+        }
+
+        ok = cqe->res <= 0 || logicPressureReady(u->pressurePorts[index], u->pressureFds[index]);
+
+        /* Trigger is gone with its cgroup, stop polling it */
+        if(ok && !more && !(cqe->res > 0 && (cqe->res & POLLERR))) {
+            ok = uringArmPoll(u, u->pressureFds[index], true, URING_PRESSURE_POLL, index);
+        }
+        return ok;
+    }
+
+    if(type == URING_PORT_POLL) {
+        ok = logicPortReady(u->ports[index]);
+    } else {
+        if(cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            uint8_t* buf = u->buffers + bid * URING_BUFFER_SIZE;
+
+            if(cqe->res > 0) {
+                if(type == URING_PORT_RECV) {
+                    ok = logicPortMessage(u->ports[index], portParseMessage(buf, cqe->res));
+                } else {
+                    WDTPort* port;
+                    int msg = udpParse(u->listeners[index], buf, cqe->res, &port);
+                    if(msg != WDT_MSG_NONE) {
+                        ok = logicPortMessage(port, msg);
+                    }
+                }
+            }
+
+            uringRecycleBuffer(u, bid);
+        } else if(cqe->res == -EINVAL && u->multishot) {
+            /* Pre 6.0 kernel, continue with single shot receives */
+            u->multishot = false;
+        } else if(cqe->res < 0 && cqe->res != -ENOBUFS) {
+            errno = -cqe->res;
+            return false;
+        }
+    }
+
+    if(ok && !more) {
+        if(type == URING_LISTENER_RECV) {
+            ok = uringArmRecv(u, u->listeners[index]->fd, URING_LISTENER_RECV, index);
+        } else {
+            ok = uringArmPort(u, index);
+        }
+    }
+
+    return ok;
+}
+
+bool uringWait(WDTUring* u, uint64_t timeoutNs, uint64_t* wokeNs)
+{
+    /* Completion of asynchronous driver kicks */
+    for(unsigned int i=0; i<u->numDrivers; i++) {
+        if(u->drivers[i]->wdtKickPending && !u->driverArmed[i]) {
+            if(!uringArmPoll(u, u->drivers[i]->wdtKickFd, false, URING_DRIVER_POLL, i)) return false;
+            u->driverArmed[i] = true;
+        }
+    }
+
+    /* Exit of running health checks */
+    for(unsigned int i=0; i<u->numChecks; i++) {
+        if(u->checks[i]->check->pidFd >= 0 && !u->checkArmed[i]) {
+            if(!uringArmPoll(u, u->checks[i]->check->pidFd, false, URING_CHECK_POLL, i)) return false;
+            u->checkArmed[i] = true;
+        }
+    }
+
+    __atomic_store_n(u->sqTail, u->sqLocalTail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeoutNs / 1000000000ULL,
+        .tv_nsec = timeoutNs % 1000000000ULL
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+        .ts = (uint64_t)(uintptr_t)&ts
+    };
+
+    /* Only sleep when nothing is waiting to be reaped */
+    bool wait = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE) == *u->cqHead;
+    if(wait || uringPending(u)) {
+        int ret = uringEnter(u, uringPending(u), wait ? 1 : 0, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if(ret < 0 && errno != ETIME && errno != EINTR) {
+            return false;
+        }
+    }
+
+    *wokeNs = utilGetMonotonicNs();
+
+    unsigned int head = *u->cqHead;
+    unsigned int tail = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE);
+    bool ok = true;
+
+    for(; head != tail && ok; head++) {
+        ok = uringComplete(u, &u->cqes[head & *u->cqMask]);
+    }
+
+    __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+
+    /* Hand consumed buffers back to the kernel */
+    __atomic_store_n(&u->bufRing->tail, u->bufTail, __ATOMIC_RELEASE);
+
+    return ok;
+}
+
+void uringFree(WDTUring* u)
+{
+    if(!u) return;
+
+    /* Closing the ring cancels all outstanding requests */
+    if(u->fd >= 0) {
+        close(u->fd);
+    }
+
+    if(u->sqRing && u->sqRing != MAP_FAILED) {
+        munmap(u->sqRing, u->sqRingSize);
+    }
+    if(u->cqRing && u->cqRing != MAP_FAILED && u->cqRing != u->sqRing) {
+        munmap(u->cqRing, u->cqRingSize);
+    }
+    if(u->sqes && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqesSize);
+    }
+    if(u->bufRing && u->bufRing != MAP_FAILED) {
+        munmap(u->bufRing, u->bufRingSize);
+    }
+
+    free(u->buffers);
+    free(u->ports);
+    free(u->listeners);
+    free(u->drivers);
+    free(u->driverArmed);
+    free(u->checks);
+    free(u->checkArmed);
+    free(u->pressurePorts);
+    free(u->pressureFds);
+    free(u);
+}
+
+WDTUring* uringNew(WDTSystem* s)
+{
+    WDTUring* u = (WDTUring*)calloc(1, sizeof(WDTUring));
+    if(!u) return NULL;
+
+    u->multishot = true;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(u->fd < 0) goto error;
+
+    /* Waiting with a timeout in io_uring_enter needs 5.11 */
+    if(!(p.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        goto error;
+    }
+
+    u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(u->cqRingSize > u->sqRingSize) u->sqRingSize = u->cqRingSize;
+        u->cqRingSize = u->sqRingSize;
+    }
+
+    u->sqRing = mmap(NULL, u->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->sqRing == MAP_FAILED) goto error;
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cqRing = u->sqRing;
+    } else {
+        u->cqRing = mmap(NULL, u->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if(u->cqRing == MAP_FAILED) goto error;
+    }
+
+    u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED) goto error;
+
+    u->sqHead = (unsigned*)((uint8_t*)u->sqRing + p.sq_off.head);
+    u->sqTail = (unsigned*)((uint8_t*)u->sqRing + p.sq_off.tail);
+    u->sqMask = (unsigned*)((uint8_t*)u->sqRing + p.sq_off.ring_mask);
+    u->sqArray = (unsigned*)((uint8_t*)u->sqRing + p.sq_off.array);
+    u->sqEntries = p.sq_entries;
+    u->sqLocalTail = *u->sqTail;
+
+    u->cqHead = (unsigned*)((uint8_t*)u->cqRing + p.cq_off.head);
+    u->cqTail = (unsigned*)((uint8_t*)u->cqRing + p.cq_off.tail);
+    u->cqMask = (unsigned*)((uint8_t*)u->cqRing + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((uint8_t*)u->cqRing + p.cq_off.cqes);
+
+    /* Provided buffer ring, needs 5.19 */
+    u->bufRingSize = URING_BUFFERS * sizeof(struct io_uring_buf);
+    u->bufRing = mmap(NULL, u->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(u->bufRing == MAP_FAILED) goto error;
+
+    u->buffers = (uint8_t*)malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    if(!u->buffers) goto error;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID;
+
+    if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto error;
+
+    for(unsigned int i=0; i<URING_BUFFERS; i++) {
+        uringRecycleBuffer(u, i);
+    }
+    __atomic_store_n(&u->bufRing->tail, u->bufTail, __ATOMIC_RELEASE);
+
+    /* Index the event sources, user_data refers to them by position */
+    for(WDTPort* port = s->port; port; port=port->next) u->numPorts++;
+    for(WDTListener* l = s->listener; l; l=l->next) u->numListeners++;
+    for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) u->numDrivers++;
+    for(WDTPort* port = s->port; port; port=port->next) {
+        if(port->check) u->numChecks++;
+        for(int r=0; port->cgroup && r<WDT_CGROUP_PRESSURE_MAX; r++) {
+            if(port->cgroup->pressureFd[r] >= 0) u->numPressure++;
+        }
+    }
+
+    u->ports = (WDTPort**)calloc(u->numPorts + 1, sizeof(WDTPort*));
+    u->listeners = (WDTListener**)calloc(u->numListeners + 1, sizeof(WDTListener*));
+    u->drivers = (WDTHWDriver**)calloc(u->numDrivers + 1, sizeof(WDTHWDriver*));
+    u->driverArmed = (bool*)calloc(u->numDrivers + 1, sizeof(bool));
+    u->checks = (WDTPort**)calloc(u->numChecks + 1, sizeof(WDTPort*));
+    u->checkArmed = (bool*)calloc(u->numChecks + 1, sizeof(bool));
+    u->pressurePorts = (WDTPort**)calloc(u->numPressure + 1, sizeof(WDTPort*));
+    u->pressureFds = (int*)calloc(u->numPressure + 1, sizeof(int));
+    if(!u->ports || !u->listeners || !u->drivers || !u->driverArmed || !u->checks || !u->checkArmed ||
+       !u->pressurePorts || !u->pressureFds) goto error;
+
+    unsigned int i = 0;
+    for(WDTPort* port = s->port; port; port=port->next) {
+        u->ports[i] = port;
+        if(!uringArmPort(u, i++)) goto error;
+    }
+
+    i = 0;
+    for(WDTListener* l = s->listener; l; l=l->next) {
+        u->listeners[i] = l;
+        if(!uringArmRecv(u, l->fd, URING_LISTENER_RECV, i++)) goto error;
+    }
+
+    i = 0;
+    for(WDTHWDriver* driver = s->wdtDriver; driver; driver=driver->next) {
+        u->drivers[i++] = driver;
+    }
+
+    i = 0;
+    for(WDTPort* port = s->port; port; port=port->next) {
+        if(port->check) u->checks[i++] = port;
+    }
+
+    /* Pressure stall triggers, polled directly for POLLPRI */
+    i = 0;
+    for(WDTPort* port = s->port; port; port=port->next) {
+        for(int r=0; port->cgroup && r<WDT_CGROUP_PRESSURE_MAX; r++) {
+            if(port->cgroup->pressureFd[r] < 0) continue;
+            u->pressurePorts[i] = port;
+            u->pressureFds[i] = port->cgroup->pressureFd[r];
+            if(!uringArmPoll(u, u->pressureFds[i], true, URING_PRESSURE_POLL, i)) goto error;
+            i++;
+        }
+    }
+
+    return u;
+
+error:
+    ;
+    int err = errno;
+    uringFree(u);
+    errno = err;
+    return NULL;
+}
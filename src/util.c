@@ -26,8 +26,11 @@
  */
 
 #include "project.h"
+#include <spawn.h>
 #include <sys/sysinfo.h>
 
+extern char** environ;
+
 
 uint64_t utilGetUptimeSeconds()
 {
@@ -36,3 +39,39 @@ uint64_t utilGetUptimeSeconds()
 
     return info.uptime;
 }
+
+uint64_t utilGetMonotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+pid_t utilSpawnShell(const char* command)
+{
+    char* argv[] = { (char*)"/bin/sh", (char*)"-c", (char*)command, NULL };
+    posix_spawnattr_t attr;
+    sigset_t set;
+    pid_t pid;
+
+    posix_spawnattr_init(&attr);
+
+    /* New process group, no blocked signals and the default SIGPIPE we ignore */
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigemptyset(&set);
+    posix_spawnattr_setsigmask(&attr, &set);
+    sigaddset(&set, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &set);
+
+    int err = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+
+    if(err) {
+        errno = err;
+        return -1;
+    }
+
+    return pid;
+}